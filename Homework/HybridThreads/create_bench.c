@@ -0,0 +1,106 @@
+/*
+create_bench - how fast threads can be created, one at a time versus
+with create_new_threads_bulk
+
+Like make_25_threads in create_para_tests.c, a few parent threads each
+create a batch of children, here over and over: after each batch the
+parent yields until its children have all finished.  Each parent
+times just its create calls, so creates/sec is the number of threads
+created divided by the total time parents spent creating them.  The
+children do nothing, so wall clock time is mostly creating, running
+and reaping threads.
+
+    make create_bench
+    ./create_bench
+
+The batch sizes are limited by MAX_THREADS in hybrid_threads.c.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "hybrid_threads.h"
+
+#define NUM_PARENTS 4
+#define CHILDREN_PER_PARENT 24
+#define BATCHES 2000
+
+struct parent {
+    atomic_int children_done;
+    long create_ns;
+};
+
+struct parent parents[NUM_PARENTS];
+bool bulk;
+
+long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void child(void* arg)
+{
+    struct parent* p = arg;
+    atomic_fetch_add(&p->children_done, 1);
+}
+
+void create_batches(void* arg)
+{
+    struct parent* p = arg;
+    void* parameters[CHILDREN_PER_PARENT];
+    for(int i = 0; i < CHILDREN_PER_PARENT; i++) {
+        parameters[i] = p;
+    }
+    for(int batch = 0; batch < BATCHES; batch++) {
+        atomic_store(&p->children_done, 0);
+        long start = now_ns();
+        if(bulk) {
+            create_new_threads_bulk(child, parameters, CHILDREN_PER_PARENT);
+        } else {
+            for(int i = 0; i < CHILDREN_PER_PARENT; i++) {
+                create_new_parameterized_thread(child, p);
+            }
+        }
+        p->create_ns += now_ns() - start;
+        while(atomic_load(&p->children_done) < CHILDREN_PER_PARENT) {
+            yield();
+        }
+    }
+}
+
+void run(int schedulers, bool use_bulk)
+{
+    bulk = use_bulk;
+    initialize_basic_threads();
+    for(int i = 0; i < NUM_PARENTS; i++) {
+        parents[i].create_ns = 0;
+        create_new_parameterized_thread(create_batches, &parents[i]);
+    }
+    long start = now_ns();
+    schedule_hybrid_threads(schedulers);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    long create_ns = 0;
+    for(int i = 0; i < NUM_PARENTS; i++) {
+        create_ns += parents[i].create_ns;
+    }
+    double creates = (double) NUM_PARENTS * BATCHES * CHILDREN_PER_PARENT;
+    printf("%10d %8s %10.3f %14.0f %14.1f\n", schedulers, bulk ? "bulk" : "loop", elapsed,
+           creates * 1e9 / create_ns, create_ns / creates);
+}
+
+int main(int argc, char *argv[]) {
+
+    int scheduler_counts[] = {1, 4, 16};
+    int num_counts = sizeof scheduler_counts / sizeof *scheduler_counts;
+
+    printf("%d parents creating %d batches of %d threads\n", NUM_PARENTS, BATCHES, CHILDREN_PER_PARENT);
+    printf("%10s %8s %10s %14s %14s\n", "pthreads", "create", "seconds", "creates/sec", "ns/create");
+    for(int i = 0; i < num_counts; i++) {
+        run(scheduler_counts[i], false);
+        run(scheduler_counts[i], true);
+    }
+}
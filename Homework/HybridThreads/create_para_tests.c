@@ -109,6 +109,80 @@ void test_pthreads_live_even_if_initially_uneeded(CuTest *tc) {
     CuAssertIntEquals(tc, 1, count2);
 }
 
+#define AFFINE_SCHEDULERS 4
+#define AFFINE_THREADS 20
+#define AFFINE_YIELDS 50
+
+int affine_turns;
+int bad_scheduler_ids;
+
+void check_scheduler_ids(void* arg)
+{
+    for(int turn = 0; turn < AFFINE_YIELDS; turn++) {
+        int id = current_scheduler_id();
+        if(id < 0 || id >= AFFINE_SCHEDULERS) {
+            __atomic_fetch_add(&bad_scheduler_ids, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&affine_turns, 1, __ATOMIC_RELAXED);
+        yield();
+    }
+}
+
+void create_affine_children()
+{
+    // hints past the last scheduler wrap around
+    for(long i = 0; i < AFFINE_THREADS / 2; i++) {
+        create_new_affine_thread(check_scheduler_ids, NULL, i + 1);
+    }
+}
+
+void test_affine_threads(CuTest *tc) {
+
+    affine_turns = 0;
+    bad_scheduler_ids = 0;
+    initialize_basic_threads();
+    for(long i = 0; i < AFFINE_THREADS / 2; i++) {
+        create_new_affine_thread(check_scheduler_ids, NULL, i);
+    }
+    create_new_thread(create_affine_children);
+    schedule_hybrid_threads(AFFINE_SCHEDULERS);
+    CuAssertIntEquals(tc, AFFINE_THREADS * AFFINE_YIELDS, affine_turns);
+    CuAssertIntEquals(tc, 0, bad_scheduler_ids);
+    CuAssertIntEquals(tc, -1, current_scheduler_id());
+}
+
+long bulk_sum;
+
+void add_parameter_to_sum(void* arg)
+{
+    __atomic_fetch_add(&bulk_sum, (long) arg, __ATOMIC_RELAXED);
+    yield();
+    __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+}
+
+void make_25_threads_in_bulk()
+{
+    void* parameters[25];
+    for(long i = 0; i < 25; i++) {
+        parameters[i] = (void*) (i + 1);
+    }
+    create_new_threads_bulk(add_parameter_to_sum, parameters, 25);
+}
+
+void test_create_in_bulk(CuTest *tc) {
+
+    count = 0;
+    bulk_sum = 0;
+    initialize_basic_threads();
+    // once before the schedulers start, then from inside threads
+    create_new_threads_bulk(add_parameter_to_sum, NULL, 20);
+    for(int i = 0; i < 3; i++) {
+        create_new_thread(make_25_threads_in_bulk);
+    }
+    schedule_hybrid_threads(3);
+    CuAssertIntEquals(tc, 95, count);
+    CuAssertIntEquals(tc, 3 * 25 * 26 / 2, bulk_sum);
+}
 
 
 int main(int argc, char *argv[]) {
@@ -122,6 +196,8 @@ int main(int argc, char *argv[]) {
     SUITE_ADD_TEST(suite, test_create_a_lot_with_extra_threads);
     SUITE_ADD_TEST(suite, test_parent_and_child_run_in_parallel);
     SUITE_ADD_TEST(suite, test_pthreads_live_even_if_initially_uneeded);
+    SUITE_ADD_TEST(suite, test_affine_threads);
+    SUITE_ADD_TEST(suite, test_create_in_bulk);
 
     CuSuiteRun(suite);
     CuSuiteSummary(suite, output);
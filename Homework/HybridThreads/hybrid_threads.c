@@ -0,0 +1,1641 @@
+/*
+Hybrid Threads - a rudimentary userspace threads library that runs
+userspace threads on several scheduler pthreads at once
+
+Author: Buffalo (hewner@rose-hulman.edu) and you!
+
+Contrary to C convention (but for your convenience) we've documented
+these functions here in the .c file rather than the header.
+
+ */
+// for CPU_SET and pthread_attr_setaffinity_np
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <ucontext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "hybrid_threads.h"
+#include "uthread_trace.h"
+
+// 64kB stack
+#define THREAD_STACK_SIZE 1024*64
+
+// max number of threads
+#define MAX_THREADS 16384
+
+// max number of scheduler pthreads schedule_hybrid_threads will start
+#define MAX_SCHEDULERS 64
+
+#define INVALID 0
+#define PAUSED 1
+#define RUNNING 2
+#define FINISHED 3
+#define CREATING 4
+#define WAITING 5
+// replay only: stopped partway through a turn (see replay_sync)
+#define HELD 6
+
+/*
+Context switching goes through thread_context / switch_context so the
+mechanism can be picked at build time.  By default it's ucontext.
+Building with -DFAST_CONTEXT_SWITCH (x86-64 only) uses fast_context.S
+instead, which skips swapcontext's signal mask system call.
+*/
+#ifdef FAST_CONTEXT_SWITCH
+#ifndef __x86_64__
+#error "FAST_CONTEXT_SWITCH is only implemented for x86-64"
+#endif
+#include "fast_context.h"
+typedef void* thread_context;
+#else
+typedef ucontext_t thread_context;
+#endif
+
+// storage for your thread data
+thread_context threads[MAX_THREADS];
+void* thread_stacks[MAX_THREADS];
+_Atomic char thread_state[MAX_THREADS];
+void (*thread_functions[MAX_THREADS])(void*);
+void* thread_parameters[MAX_THREADS];
+
+// links for whichever uthread_wait_queue a WAITING thread is parked on
+int thread_next_waiter[MAX_THREADS];
+
+/*
+Affinity.  Each thread has a home scheduler it goes back to whenever
+it is made runnable: the one that last ran it, or for a thread made
+with create_new_affine_thread, always the one asked for.  The home
+scheduler's caches (and, since stacks are allocated by the first
+scheduler to run the thread, its NUMA node) are where the thread's
+data is likely to be.  -1 means no home yet.
+*/
+int thread_home[MAX_THREADS];
+bool thread_home_fixed[MAX_THREADS];
+
+// links for the scheduler inboxes (see inbox_push)
+int thread_next_inbox[MAX_THREADS];
+
+/*
+Unused slots sit on a lock-free stack linked through thread_next_free,
+so claiming a slot or giving one back is O(1) instead of a scan of
+thread_state.  free_slots packs the top slot's index + 1 (0 for
+empty) in its low 32 bits with a count of pops in the high 32 bits.
+If a slot is popped and pushed back while another pthread is in the
+middle of popping, the count has changed and that pthread's
+compare-and-swap fails, instead of installing a stale next link (the
+ABA problem).
+*/
+atomic_int thread_next_free[MAX_THREADS];
+atomic_ullong free_slots;
+
+// threads numbered in creation order, for the trace (slots get reused)
+unsigned int thread_serial[MAX_THREADS];
+atomic_uint next_serial;
+
+// count of slots that are not INVALID.  The schedulers can return
+// once this reaches 0.
+atomic_int live_threads;
+
+/*
+run_queue
+
+Each scheduler pthread owns one run queue of PAUSED thread indexes.
+Only the owning pthread ever pushes onto it (a thread that yields or
+creates a new thread is always running on the owner), so pushing needs
+no atomic read-modify-write.  Any scheduler can take from the head with
+a compare-and-swap, which is how an idle scheduler steals work from a
+busy one without a lock.
+
+The owner takes from the head too (rather than popping the tail like a
+classic work-stealing deque) so a thread that yields goes to the back
+of the line and the schedulers still round robin.
+
+A thread index is in at most one queue at a time, so a queue can never
+hold more than MAX_THREADS entries.  The size must be a power of 2 so
+the indexes stay right when head and tail wrap around.
+*/
+#define RUN_QUEUE_SIZE MAX_THREADS
+
+struct run_queue {
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    atomic_int slots[RUN_QUEUE_SIZE];
+};
+
+struct scheduler {
+    struct run_queue queue;
+
+    // threads other pthreads made runnable with us as their home, a
+    // lock-free stack of thread indexes linked through
+    // thread_next_inbox (-1 when empty)
+    _Alignas(64) atomic_int inbox;
+
+    thread_context context;
+    pthread_t pthread;
+    int id;
+
+    // a wait queue lock the thread that just parked is still holding;
+    // released once we're off that thread's stack (see park_thread)
+    atomic_flag* release_after_switch;
+
+    // likewise, an fd the thread that just parked is waiting on; it is
+    // only armed in epoll once we're off its stack (see wait_for_fd)
+    int watch_fd;
+    uint32_t watch_events;
+
+    // scheduling decisions made, for deciding when to check for I/O
+    unsigned int picks;
+};
+
+struct scheduler schedulers[MAX_SCHEDULERS];
+int num_schedulers;
+
+// threads created before schedule_hybrid_threads starts wait here
+// until they are handed out to the schedulers
+struct run_queue unscheduled;
+
+__thread struct scheduler* current_scheduler;
+__thread int current_thread_index;
+
+// one trace ring per scheduler pthread, plus one for whatever creates
+// threads before schedule_hybrid_threads (see uthread_trace_start)
+bool tracing;
+struct trace_ring trace_rings[MAX_SCHEDULERS + 1];
+struct trace_calibration trace_calibration;
+
+/*
+Record and replay (see uthread_record).  The log is a header and then
+one 8 byte event per scheduling decision, thread creation, or
+synchronization point (taking a wait queue lock, or doing I/O), in
+the order they happened.  While recording, the file is mapped shared and
+each event's place in it is claimed with one atomic add on the
+header's count, so the log is already in the page cache if the
+program crashes.  A slot claimed but never written stays zero, which
+ends the log.
+*/
+#define REPLAY_MAGIC "UTREPLAY"
+#define REPLAY_MAX_EVENTS (1ULL << 26)
+
+// event types, in the top 2 bits of what
+#define REPLAY_RUN 1u
+#define REPLAY_CREATE 2u
+#define REPLAY_SYNC 3u
+#define REPLAY_TYPE(what) ((what) >> 30)
+#define REPLAY_DETAIL(what) ((what) & ((1u << 30) - 1))
+
+struct replay_event {
+    // the type, then for REPLAY_RUN the scheduler that claimed the
+    // thread, for REPLAY_CREATE 1 + the serial of the thread that
+    // created it (0 if it was made outside any thread)
+    uint32_t what;
+    // serial of the thread run, created or synchronizing
+    uint32_t thread;
+};
+
+struct replay_header {
+    char magic[8];
+    atomic_ullong count;
+};
+
+bool recording;
+struct replay_header* record_header;
+struct replay_event* record_events;
+int record_fd = -1;
+char record_path[PATH_MAX];
+
+bool replaying;
+struct replay_event* replay_events;
+size_t replay_count;
+// the next event to replay, not counting creations
+size_t replay_next;
+// the slot of the thread with each serial
+int* replay_slot;
+// each creator's recorded children, as a list of their REPLAY_CREATE
+// events: replay_first_child by creator (1 + serial, 0 for outside
+// any thread), linked through replay_next_child by event
+long* replay_first_child;
+long* replay_next_child;
+uint32_t replay_max_serial;
+
+/*
+Idle schedulers sleep on a futex instead of spinning.  work_seq is the
+futex word: it changes every time a sleeper is woken, so a scheduler
+that read it before deciding to sleep won't miss a wakeup that happened
+after.  idle_schedulers lets the common case (nobody asleep) skip the
+system call entirely.
+
+SPIN_IDLE_SCHEDULERS brings back sched_yield busy waiting so
+idle_bench can compare the two.  The single array scheduler always
+spins, as it has no cheap way to tell whether there is spare work.
+ */
+#if defined(SINGLE_ARRAY_SCHEDULER) && !defined(SPIN_IDLE_SCHEDULERS)
+#define SPIN_IDLE_SCHEDULERS
+#endif
+
+atomic_uint work_seq;
+atomic_int idle_schedulers;
+
+/*
+I/O.  A thread whose read or write would block is parked and its fd
+is armed in one shared epoll set with EPOLLONESHOT, tagged with the
+thread's index.  One idle scheduler at a time (whoever holds
+io_polling) sleeps in epoll_wait instead of on the futex.  Busy
+schedulers also check for ready fds every IO_POLL_INTERVAL picks so
+I/O doesn't wait behind threads that keep yielding.  io_kick_fd is an
+eventfd in the epoll set that wakes the polling scheduler when other
+work turns up.
+ */
+#define IO_POLL_INTERVAL 32
+#define IO_EVENTS 64
+#define IO_KICK_TAG UINT64_MAX
+
+int io_epoll_fd = -1;
+int io_kick_fd = -1;
+atomic_int io_waiting;
+atomic_flag io_polling = ATOMIC_FLAG_INIT;
+atomic_bool io_poller_asleep;
+
+// holds every scheduler back until all of them exist, so a thread
+// made runnable right away has somewhere to go
+pthread_barrier_t schedulers_started;
+
+#ifdef SINGLE_ARRAY_SCHEDULER
+// the original design: every scheduler scans the shared thread_state
+// array for a PAUSED thread while holding this semaphore.  It is kept
+// so yield_bench has something to compare the run queues against.
+sem_t claim_lock;
+__thread int last_claimed_index;
+#endif
+
+static void trace(int index, int type) {
+    if(tracing) {
+        int ring = current_scheduler == NULL ? MAX_SCHEDULERS : current_scheduler->id;
+        trace_record(&trace_rings[ring], thread_serial[index], type);
+    }
+}
+
+static void record_event(uint32_t type, uint32_t detail, uint32_t thread) {
+    unsigned long long n = atomic_fetch_add_explicit(&record_header->count, 1, memory_order_relaxed);
+    if(n == REPLAY_MAX_EVENTS) {
+        printf("replay log %s is full, later events aren't recorded\n", record_path);
+    }
+    if(n < REPLAY_MAX_EVENTS) {
+        record_events[n].thread = thread;
+        record_events[n].what = type << 30 | detail;
+    }
+}
+
+static void replay_diverged(const char* what, uint32_t serial) {
+    printf("replay diverged from the log: %s %u\n", what, serial);
+    exit(1);
+}
+
+// the next event to replay, skipping creations (assign_serials finds
+// those by creator), or NULL at the end of the log
+static struct replay_event* replay_peek() {
+    while(replay_next < replay_count &&
+          REPLAY_TYPE(replay_events[replay_next].what) == REPLAY_CREATE) {
+        replay_next++;
+    }
+    return replay_next < replay_count ? &replay_events[replay_next] : NULL;
+}
+
+/*
+assign_serials
+
+Numbers n new threads.  Normally that's just the next n serials.
+While recording, each creation is logged against the thread creating
+it.  While replaying, each thread instead gets the serial it had when
+recorded, found from who is creating it and how many threads that
+creator has made so far - so the numbering matches the log even
+though, recorded across several pthreads, creations raced.
+ */
+static void assign_serials(const int* indexes, int n) {
+    uint32_t creator = current_scheduler == NULL ? 0 : thread_serial[current_thread_index] + 1;
+    if(replaying) {
+        for(int i = 0; i < n; i++) {
+            long event = creator <= replay_max_serial + 1 ? replay_first_child[creator] : -1;
+            if(event < 0) {
+                replay_diverged("unrecorded thread created by creator", creator);
+            }
+            replay_first_child[creator] = replay_next_child[event];
+            uint32_t serial = replay_events[event].thread;
+            thread_serial[indexes[i]] = serial;
+            replay_slot[serial] = indexes[i];
+        }
+        return;
+    }
+    unsigned int serial = atomic_fetch_add(&next_serial, n);
+    for(int i = 0; i < n; i++) {
+        thread_serial[indexes[i]] = serial + i;
+        if(recording) {
+            record_event(REPLAY_CREATE, creator, serial + i);
+        }
+    }
+}
+
+static void switch_context(thread_context* save, thread_context* resume) {
+#ifdef FAST_CONTEXT_SWITCH
+    fast_switch(save, *resume);
+#else
+    swapcontext(save, resume);
+#endif
+}
+
+#ifndef SPIN_IDLE_SCHEDULERS
+static void futex_wait(atomic_uint* word, unsigned int expected) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void kick_io_poller() {
+    uint64_t one = 1;
+    if(write(io_kick_fd, &one, sizeof one) < 0) {
+        perror("write to eventfd");
+    }
+}
+#endif
+
+// wakes count sleeping schedulers, if there are any
+static void wake_idle_schedulers(int count) {
+#ifdef SPIN_IDLE_SCHEDULERS
+    (void) count;
+#else
+    // pairs with the fence in park_scheduler: either we see the
+    // sleeper's increment or it sees the work we just published
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&idle_schedulers, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&work_seq, 1);
+        long woken = syscall(SYS_futex, &work_seq, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+        // the scheduler in epoll_wait is idle too
+        if(woken < count && atomic_load(&io_poller_asleep)) {
+            kick_io_poller();
+        }
+    }
+#endif
+}
+
+static void runq_reset(struct run_queue *q) {
+    atomic_store(&q->head, 0);
+    atomic_store(&q->tail, 0);
+}
+
+// only ever called by the pthread that owns q
+static void runq_push(struct run_queue *q, int index) {
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    atomic_store_explicit(&q->slots[tail % RUN_QUEUE_SIZE], index, memory_order_relaxed);
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+#ifndef SINGLE_ARRAY_SCHEDULER
+/*
+inbox_push
+
+Hands a PAUSED thread to another scheduler.  Its run queue only takes
+pushes from its owner, so the thread goes on the owner's inbox
+instead, which any pthread can push to.  Whoever empties an inbox
+takes the whole list with one exchange, so there is no ABA problem.
+The owner moves its inbox into its run queue every time it picks a
+thread, and a scheduler looking for work to steal takes inboxes too,
+so a thread waiting in the inbox of a sleeping scheduler still runs.
+*/
+static void inbox_push(struct scheduler* target, int index) {
+    int first = atomic_load_explicit(&target->inbox, memory_order_relaxed);
+    do {
+        thread_next_inbox[index] = first;
+    } while(!atomic_compare_exchange_weak_explicit(&target->inbox, &first, index,
+                                                   memory_order_release,
+                                                   memory_order_relaxed));
+}
+
+// moves everything in from's inbox onto our own run queue, oldest first
+static void inbox_drain(struct scheduler* from, struct scheduler* self) {
+    if(atomic_load_explicit(&from->inbox, memory_order_relaxed) < 0) {
+        return;
+    }
+    int index = atomic_exchange_explicit(&from->inbox, -1, memory_order_acquire);
+    // the inbox is newest first, so reverse it
+    int oldest_first = -1;
+    while(index >= 0) {
+        int next = thread_next_inbox[index];
+        thread_next_inbox[index] = oldest_first;
+        oldest_first = index;
+        index = next;
+    }
+    for(index = oldest_first; index >= 0; index = thread_next_inbox[index]) {
+        runq_push(&self->queue, index);
+    }
+}
+
+// the scheduler a thread should be made runnable on, or NULL if
+// any will do
+static struct scheduler* home_of(int index) {
+    if(thread_home[index] < 0) {
+        return NULL;
+    }
+    return &schedulers[thread_home[index] % num_schedulers];
+}
+#endif
+
+#ifndef SINGLE_ARRAY_SCHEDULER
+static unsigned int runq_length(struct run_queue *q) {
+    return atomic_load_explicit(&q->tail, memory_order_relaxed) -
+        atomic_load_explicit(&q->head, memory_order_relaxed);
+}
+#endif
+
+#ifndef SINGLE_ARRAY_SCHEDULER
+// pushes n threads with a single update of tail, so takers see all of
+// them appear at once
+static void runq_push_many(struct run_queue *q, const int* indexes, int n) {
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for(int i = 0; i < n; i++) {
+        atomic_store_explicit(&q->slots[(tail + i) % RUN_QUEUE_SIZE], indexes[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&q->tail, tail + n, memory_order_release);
+}
+#endif
+
+// safe to call from any pthread; returns -1 if q is empty
+static int runq_take(struct run_queue *q) {
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+    while(1) {
+        unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if(head == tail) {
+            return -1;
+        }
+        int index = atomic_load_explicit(&q->slots[head % RUN_QUEUE_SIZE], memory_order_relaxed);
+        if(atomic_compare_exchange_weak_explicit(&q->head, &head, head + 1,
+                                                 memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+            return index;
+        }
+    }
+}
+
+/*
+make_runnable
+
+Publishes a PAUSED thread so some scheduler can claim it.  A thread
+with a home scheduler goes back to it; others made runnable from
+inside a scheduler go on that scheduler's own queue.  This is called
+while some thread is still running on the current scheduler, so the
+new thread is spare work and one idle scheduler is woken to steal it.
+ */
+static void make_runnable(int index) {
+#ifdef SINGLE_ARRAY_SCHEDULER
+    // being PAUSED in thread_state is all it takes
+    (void) index;
+#else
+    if(replaying) {
+        // the log says what runs next, so being PAUSED is enough
+        return;
+    }
+    if(current_scheduler == NULL) {
+        runq_push(&unscheduled, index);
+        wake_idle_schedulers(1);
+        return;
+    }
+    struct scheduler* home = home_of(index);
+    if(home == NULL || home == current_scheduler) {
+        runq_push(&current_scheduler->queue, index);
+    } else {
+        inbox_push(home, index);
+    }
+    wake_idle_schedulers(1);
+#endif
+}
+
+#ifndef SINGLE_ARRAY_SCHEDULER
+static int steal_thread(struct scheduler* self) {
+    for(int i = 1; i < num_schedulers; i++) {
+        struct scheduler* victim = &schedulers[(self->id + i) % num_schedulers];
+        int index = runq_take(&victim->queue);
+        if(index >= 0) {
+            return index;
+        }
+    }
+    // the victims' own queues come first, as a thread in an inbox is
+    // one its home scheduler would rather run itself
+    for(int i = 1; i < num_schedulers; i++) {
+        inbox_drain(&schedulers[(self->id + i) % num_schedulers], self);
+    }
+    return runq_take(&self->queue);
+}
+#endif
+
+/*
+find_runnable_thread
+
+Claims a PAUSED thread for this scheduler to run, or returns -1 if
+there is nothing to run right now.  just_ran is the thread this
+scheduler last ran (or -1) - if that is the only thread in our own
+queue we look for other schedulers' threads first, so a yielding
+thread does not starve threads that are waiting elsewhere.
+ */
+static int find_runnable_thread(struct scheduler* self, int just_ran) {
+#ifdef SINGLE_ARRAY_SCHEDULER
+    (void) self;
+    (void) just_ran;
+    int found = -1;
+    sem_wait(&claim_lock);
+    for(int i = 1; i <= MAX_THREADS; i++) {
+        int index = (last_claimed_index + i) % MAX_THREADS;
+        if(thread_state[index] == PAUSED) {
+            thread_state[index] = RUNNING;
+            last_claimed_index = index;
+            found = index;
+            break;
+        }
+    }
+    sem_post(&claim_lock);
+    return found;
+#else
+    inbox_drain(self, self);
+    int index = runq_take(&self->queue);
+    if(index >= 0 && index == just_ran) {
+        int stolen = steal_thread(self);
+        if(stolen >= 0) {
+            runq_push(&self->queue, index);
+            return stolen;
+        }
+    }
+    if(index >= 0) {
+        return index;
+    }
+    return steal_thread(self);
+#endif
+}
+
+/*
+poll_io
+
+Makes runnable every thread whose fd epoll says is ready, waiting up
+to timeout_ms (-1 for as long as it takes), and returns how many there
+were.  Only the holder of io_polling may call this.
+ */
+static int poll_io(int timeout_ms) {
+    struct epoll_event events[IO_EVENTS];
+    int n = epoll_wait(io_epoll_fd, events, IO_EVENTS, timeout_ms);
+    int woken = 0;
+    for(int i = 0; i < n; i++) {
+        if(events[i].data.u64 == IO_KICK_TAG) {
+            uint64_t kicks;
+            if(read(io_kick_fd, &kicks, sizeof kicks) < 0) {
+                perror("read from eventfd");
+            }
+            continue;
+        }
+        int index = events[i].data.u64;
+        atomic_fetch_sub(&io_waiting, 1);
+        trace(index, TRACE_READY);
+        thread_state[index] = PAUSED;
+        make_runnable(index);
+        woken++;
+    }
+    return woken;
+}
+
+// a quick non-blocking look for finished I/O, if nobody else is looking
+static void try_poll_io() {
+    if(atomic_load(&io_waiting) > 0 && !atomic_flag_test_and_set(&io_polling)) {
+        poll_io(0);
+        atomic_flag_clear(&io_polling);
+    }
+}
+
+// arms the fd a just-parked thread is waiting on
+static void watch_fd(int fd, uint32_t events, int index) {
+    struct epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.u64 = index;
+    if(epoll_ctl(io_epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        if(errno != ENOENT || epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+}
+
+#define FREE_TOP(word) ((int) ((word) & 0xffffffff) - 1)
+
+/*
+claim_invalid_slots
+
+Pops n slots off the free stack with a single compare-and-swap and
+marks them CREATING.  The links are read before the swap, so another
+pthread can change them under us; then the swap fails and we walk
+them again.  Exits the program if there aren't n free slots.
+ */
+static void claim_invalid_slots(int* indexes, int n) {
+    unsigned long long old = atomic_load_explicit(&free_slots, memory_order_acquire);
+    while(1) {
+        int index = FREE_TOP(old);
+        int claimed = 0;
+        while(claimed < n && index >= 0) {
+            indexes[claimed++] = index;
+            index = atomic_load_explicit(&thread_next_free[index], memory_order_relaxed);
+        }
+        if(claimed < n) {
+            // really out, unless the stack changed while we walked it
+            unsigned long long now = atomic_load_explicit(&free_slots, memory_order_acquire);
+            if(now == old) {
+                printf("too many threads (max is %d)\n", MAX_THREADS);
+                exit(1);
+            }
+            old = now;
+            continue;
+        }
+        unsigned long long pops = (old >> 32) + 1;
+        if(atomic_compare_exchange_weak_explicit(&free_slots, &old, pops << 32 | (unsigned int) (index + 1),
+                                                 memory_order_acquire,
+                                                 memory_order_acquire)) {
+            break;
+        }
+    }
+    for(int i = 0; i < n; i++) {
+        thread_state[indexes[i]] = CREATING;
+    }
+}
+
+static int claim_invalid_slot() {
+    int index;
+    claim_invalid_slots(&index, 1);
+    return index;
+}
+
+// gives an INVALID slot back to the free stack
+static void release_slot(int index) {
+    unsigned long long old = atomic_load_explicit(&free_slots, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&thread_next_free[index], FREE_TOP(old), memory_order_relaxed);
+    } while(!atomic_compare_exchange_weak_explicit(&free_slots, &old,
+                                                   (old & ~0xffffffffULL) | (unsigned int) (index + 1),
+                                                   memory_order_release,
+                                                   memory_order_relaxed));
+}
+
+
+/*
+initialize_basic_threads
+
+A function that resets any globals to a brand new clean state.  It is
+called before any calls to create_new_thread or
+schedule_hybrid_threads.
+ */
+void initialize_basic_threads() {
+    for(int i = 0; i < MAX_THREADS; i++) {
+        thread_state[i] = INVALID;
+        thread_stacks[i] = NULL;
+        atomic_store(&thread_next_free[i], i + 1 < MAX_THREADS ? i + 1 : -1);
+    }
+    // slot 0 on top, so the first threads get the lowest slots
+    atomic_store(&free_slots, 1);
+    atomic_store(&live_threads, 0);
+    atomic_store(&next_serial, 0);
+    atomic_store(&idle_schedulers, 0);
+    atomic_store(&io_waiting, 0);
+    runq_reset(&unscheduled);
+#ifdef SINGLE_ARRAY_SCHEDULER
+    sem_init(&claim_lock, 0, 1);
+#endif
+}
+
+static void thread_run_helper(int index) {
+    thread_functions[index](thread_parameters[index]);
+    finish_thread();
+}
+
+// called by the scheduler that runs the thread first, so the stack's
+// pages are first touched (and placed) on that scheduler's NUMA node
+static void make_thread_context(int index) {
+    thread_stacks[index] = malloc(THREAD_STACK_SIZE);
+    if(thread_stacks[index] == NULL) {
+        printf("could not malloc a thread stack\n");
+        exit(1);
+    }
+#ifdef FAST_CONTEXT_SWITCH
+    threads[index] = fast_context_make(thread_stacks[index], THREAD_STACK_SIZE, thread_run_helper, index);
+#else
+    getcontext(&threads[index]);
+    threads[index].uc_stack.ss_sp = thread_stacks[index];
+    threads[index].uc_stack.ss_size = THREAD_STACK_SIZE;
+    threads[index].uc_link = NULL;
+    makecontext(&threads[index], (void (*)()) thread_run_helper, 1, index);
+#endif
+}
+
+/*
+create_new_thread
+
+Gets a new thread ready to run, but does not start it.  Safe to call
+from inside any userspace thread, on any scheduler, at the same time.
+Exits the program if there are already MAX_THREADS threads or the
+stack cannot be malloced.  The stack is only malloced once a
+scheduler first runs the thread.
+ */
+void create_new_thread(void (*fun_ptr)()) {
+    create_new_parameterized_thread((void (*)(void*)) fun_ptr, NULL);
+}
+
+/*
+create_new_parameterized_thread
+
+Works exactly like create_new_thread, except it expects a function
+that takes a void pointer as a paramter, plus a value for that
+parameter.
+ */
+static void create_thread_with_home(void (*fun_ptr)(void*), void* parameter, int home) {
+    int index = claim_invalid_slot();
+
+    thread_functions[index] = fun_ptr;
+    thread_parameters[index] = parameter;
+    thread_stacks[index] = NULL;
+    thread_home[index] = home;
+    thread_home_fixed[index] = home >= 0;
+    assign_serials(&index, 1);
+
+    atomic_fetch_add(&live_threads, 1);
+    trace(index, TRACE_READY);
+    thread_state[index] = PAUSED;
+    make_runnable(index);
+}
+
+void create_new_parameterized_thread(void (*fun_ptr)(void*), void* parameter) {
+    create_thread_with_home(fun_ptr, parameter, -1);
+}
+
+/*
+create_new_threads_bulk
+
+Creates n threads running fun_ptr, the ith with parameters[i] (or
+NULL for all of them if parameters is NULL).  The same as calling
+create_new_parameterized_thread n times, but cheaper.  Up to
+BULK_BATCH threads at a time are claimed with one pop off the free
+slot stack, have the shared counters bumped once, and are pushed onto
+the run queue with a single update and one wakeup for the idle
+schedulers.  Exits the program if there aren't n free slots.
+
+Example usage:
+
+void* rows[10];
+...
+create_new_threads_bulk(sum_row, rows, 10);
+ */
+#define BULK_BATCH 64
+
+static void create_batch(void (*fun_ptr)(void*), void* parameters[], int n) {
+    int indexes[BULK_BATCH];
+    claim_invalid_slots(indexes, n);
+
+    for(int i = 0; i < n; i++) {
+        int index = indexes[i];
+        thread_functions[index] = fun_ptr;
+        thread_parameters[index] = parameters == NULL ? NULL : parameters[i];
+        thread_stacks[index] = NULL;
+        thread_home[index] = -1;
+        thread_home_fixed[index] = false;
+    }
+    assign_serials(indexes, n);
+    atomic_fetch_add(&live_threads, n);
+    for(int i = 0; i < n; i++) {
+        trace(indexes[i], TRACE_READY);
+        thread_state[indexes[i]] = PAUSED;
+    }
+#ifndef SINGLE_ARRAY_SCHEDULER
+    if(!replaying) {
+        runq_push_many(current_scheduler == NULL ? &unscheduled : &current_scheduler->queue, indexes, n);
+        wake_idle_schedulers(n);
+    }
+#endif
+}
+
+void create_new_threads_bulk(void (*fun_ptr)(void*), void* parameters[], int n) {
+    for(int done = 0; done < n; done += BULK_BATCH) {
+        create_batch(fun_ptr, parameters == NULL ? NULL : parameters + done,
+                     n - done < BULK_BATCH ? n - done : BULK_BATCH);
+    }
+}
+
+/*
+create_new_affine_thread
+
+Like create_new_parameterized_thread, but the thread prefers to run on
+scheduler pthread number scheduler (taken modulo the number of
+schedulers).  Whenever it yields or wakes up it goes back to that
+scheduler's queue.  It's a hint, not a promise: an idle scheduler can
+still steal it for a turn.  Threads that work on the same data can be
+given the same scheduler to share its cache.
+ */
+void create_new_affine_thread(void (*fun_ptr)(void*), void* parameter, int scheduler) {
+    if(scheduler < 0) {
+        printf("scheduler %d is not a valid affinity hint\n", scheduler);
+        exit(1);
+    }
+    create_thread_with_home(fun_ptr, parameter, scheduler);
+}
+
+/*
+current_scheduler_id
+
+The number (0 to num_pthreads-1) of the scheduler pthread running the
+calling thread, or -1 outside of schedule_hybrid_threads.
+ */
+int current_scheduler_id() {
+    return current_scheduler == NULL ? -1 : current_scheduler->id;
+}
+
+static void switched_out(int index);
+
+static void run_thread(int index) {
+    current_thread_index = index;
+    thread_state[index] = RUNNING;
+    if(thread_stacks[index] == NULL) {
+        make_thread_context(index);
+    }
+    if(!thread_home_fixed[index]) {
+        thread_home[index] = current_scheduler->id;
+    }
+    trace(index, TRACE_RUN);
+    if(recording) {
+        record_event(REPLAY_RUN, current_scheduler->id, thread_serial[index]);
+    }
+    switch_context(&current_scheduler->context, &threads[index]);
+    switched_out(index);
+}
+
+// finishes the thread's turn now that we're off its stack
+static void switched_out(int index) {
+    // each switch out is traced before anyone else can touch the
+    // thread: its slot reused, or it woken and run elsewhere
+    if(thread_state[index] == HELD) {
+        // picked up again by replay_threads, partway through its turn
+        return;
+    }
+    if(thread_state[index] == FINISHED) {
+        trace(index, TRACE_EXIT);
+        free(thread_stacks[index]);
+        thread_state[index] = INVALID;
+        release_slot(index);
+        if(atomic_fetch_sub(&live_threads, 1) == 1) {
+            // the sleepers need to notice there's nothing left and exit
+            wake_idle_schedulers(INT_MAX);
+        }
+    } else if(thread_state[index] == WAITING) {
+        // whoever wakes it will make it runnable again
+        trace(index, TRACE_BLOCK);
+        if(current_scheduler->release_after_switch != NULL) {
+            atomic_flag_clear_explicit(current_scheduler->release_after_switch, memory_order_release);
+            current_scheduler->release_after_switch = NULL;
+        }
+        if(current_scheduler->watch_fd >= 0) {
+            watch_fd(current_scheduler->watch_fd, current_scheduler->watch_events, index);
+            current_scheduler->watch_fd = -1;
+            // make sure some idle scheduler is around to poll for it
+            if(!atomic_load(&io_poller_asleep)) {
+                wake_idle_schedulers(1);
+            }
+        }
+    } else {
+        trace(index, TRACE_STOP);
+        thread_state[index] = PAUSED;
+#ifdef SINGLE_ARRAY_SCHEDULER
+        make_runnable(index);
+#else
+        if(replaying) {
+            return;
+        }
+        if(home_of(index) != current_scheduler) {
+            // a thread we stole for a turn goes back home
+            make_runnable(index);
+            return;
+        }
+        // we're about to take a thread off this queue ourselves, so
+        // only wake a sleeper if there's more than that one
+        runq_push(&current_scheduler->queue, index);
+        if(runq_length(&current_scheduler->queue) > 1) {
+            wake_idle_schedulers(1);
+        }
+#endif
+    }
+}
+
+/*
+park_scheduler
+
+Called when find_runnable_thread came up empty.  Puts this scheduler
+pthread to sleep until a thread is made runnable (or every thread has
+finished).  Returns the thread to run if some turned up while we were
+getting ready to sleep, otherwise -1.
+ */
+static int park_scheduler(struct scheduler* self) {
+#ifdef SPIN_IDLE_SCHEDULERS
+    (void) self;
+    // fewer runnable threads than schedulers; wait for a running
+    // thread to yield or create something
+    try_poll_io();
+    sched_yield();
+    return -1;
+#else
+    unsigned int seq = atomic_load(&work_seq);
+    // if threads are waiting on I/O, one of the sleepers waits in
+    // epoll_wait for them.  It says so before looking for work one
+    // last time, so anyone who publishes work after that kicks it.
+    bool polling = atomic_load(&io_waiting) > 0 && !atomic_flag_test_and_set(&io_polling);
+    if(polling) {
+        atomic_store(&io_poller_asleep, true);
+    }
+    atomic_fetch_add(&idle_schedulers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // anything published before our increment was visible is only
+    // found by looking again
+    int index = find_runnable_thread(self, -1);
+    if(index < 0 && atomic_load(&live_threads) > 0) {
+        if(polling) {
+            poll_io(-1);
+        } else {
+            futex_wait(&work_seq, seq);
+        }
+    }
+    if(polling) {
+        atomic_store(&io_poller_asleep, false);
+        atomic_flag_clear(&io_polling);
+    }
+    atomic_fetch_sub(&idle_schedulers, 1);
+    return index;
+#endif
+}
+
+static void* schedule_threads_pthread(void* arg) {
+    struct scheduler* self = arg;
+    current_scheduler = self;
+    int just_ran = -1;
+    pthread_barrier_wait(&schedulers_started);
+
+    while(atomic_load(&live_threads) > 0) {
+        if(++self->picks % IO_POLL_INTERVAL == 0) {
+            try_poll_io();
+        }
+        int index = find_runnable_thread(self, just_ran);
+        if(index < 0) {
+            just_ran = -1;
+            index = park_scheduler(self);
+            if(index < 0) {
+                continue;
+            }
+        }
+        run_thread(index);
+        just_ran = index;
+    }
+    return NULL;
+}
+
+static void stop_recording() {
+    unsigned long long count = atomic_load(&record_header->count);
+    if(count > REPLAY_MAX_EVENTS) {
+        count = REPLAY_MAX_EVENTS;
+    }
+    size_t size = sizeof(struct replay_header) + count * sizeof(struct replay_event);
+    munmap(record_header, sizeof(struct replay_header) + REPLAY_MAX_EVENTS * sizeof(struct replay_event));
+    if(ftruncate(record_fd, size) < 0) {
+        perror(record_path);
+    }
+    close(record_fd);
+    record_fd = -1;
+    recording = false;
+}
+
+/*
+replay_sync
+
+Called by the running thread at each synchronization point while
+replaying.  If the log's next event is this thread synchronizing, it
+goes ahead.  Otherwise some other thread got there first when this was
+recorded, so this one is held partway through its turn and
+replay_threads goes on with the log until it's this thread's go.
+ */
+static void replay_sync() {
+    int index = current_thread_index;
+    while(1) {
+        struct replay_event* next = replay_peek();
+        if(next == NULL) {
+            replay_diverged("the log ran out with a thread running:", thread_serial[index]);
+        }
+        if(REPLAY_TYPE(next->what) == REPLAY_SYNC && next->thread == thread_serial[index]) {
+            replay_next++;
+            return;
+        }
+        thread_state[index] = HELD;
+        switch_context(&threads[index], &current_scheduler->context);
+    }
+}
+
+// a synchronization point that isn't a wait queue lock
+static void sync_point() {
+    if(current_scheduler == NULL) {
+        return;
+    }
+    if(recording) {
+        record_event(REPLAY_SYNC, 0, thread_serial[current_thread_index]);
+    } else if(replaying) {
+        replay_sync();
+    }
+}
+
+/*
+replay_threads
+
+schedule_hybrid_threads when replaying: goes through the log on just
+the calling pthread, starting each thread's turn when the log says it
+was claimed and letting held threads past each synchronization point
+in the order the log has them.  A thread the log says to run that is
+still waiting on I/O is waited for.  Exits the program if a thread the
+log names isn't in the state it should be, as the program can't have
+done the same as when it was recorded.
+ */
+#define REPLAY_IO_WAIT_MS 1000
+
+static void replay_threads() {
+    current_scheduler = &schedulers[0];
+    struct replay_event* next;
+    while((next = replay_peek()) != NULL) {
+        uint32_t serial = next->thread;
+        int index = serial <= replay_max_serial ? replay_slot[serial] : -1;
+        if(index >= 0 && thread_serial[index] != serial) {
+            index = -1;
+        }
+        if(REPLAY_TYPE(next->what) == REPLAY_RUN) {
+            while(index >= 0 && thread_state[index] == WAITING && atomic_load(&io_waiting) > 0) {
+                if(poll_io(REPLAY_IO_WAIT_MS) == 0) {
+                    break;
+                }
+            }
+            if(index < 0 || thread_state[index] != PAUSED) {
+                replay_diverged("thread not ready to run:", serial);
+            }
+            replay_next++;
+            run_thread(index);
+        } else {
+            if(index < 0 || thread_state[index] != HELD) {
+                replay_diverged("thread not waiting to synchronize:", serial);
+            }
+            // it takes the event itself in replay_sync
+            current_thread_index = index;
+            thread_state[index] = RUNNING;
+            switch_context(&current_scheduler->context, &threads[index]);
+            switched_out(index);
+        }
+    }
+    current_scheduler = NULL;
+    if(atomic_load(&live_threads) > 0) {
+        printf("the replay log ran out with %d threads unfinished\n", atomic_load(&live_threads));
+        exit(1);
+    }
+    free(replay_events);
+    free(replay_slot);
+    free(replay_first_child);
+    free(replay_next_child);
+    replaying = false;
+}
+
+#ifndef UNPINNED_SCHEDULERS
+// spreads the schedulers over the CPUs we're allowed to run on, one
+// CPU each (round robin if there are more schedulers than CPUs)
+static void pin_scheduler(pthread_attr_t* attr, int id) {
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof allowed, &allowed) < 0) {
+        perror("sched_getaffinity");
+        return;
+    }
+    int n = id % CPU_COUNT(&allowed);
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(CPU_ISSET(cpu, &allowed) && n-- == 0) {
+            cpu_set_t pinned;
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            pthread_attr_setaffinity_np(attr, sizeof pinned, &pinned);
+            return;
+        }
+    }
+}
+#endif
+
+/*
+schedule_hybrid_threads
+
+Starts num_pthreads scheduler pthreads and returns once every thread
+has finished.  Each scheduler runs threads from its own run queue and
+steals from the others' when it runs dry.  Schedulers with nothing to
+run sleep until a thread is created, yields or wakes up.
+
+Each scheduler pthread is pinned to its own CPU, so the threads it
+keeps running keep their caches warm.  Build with -DUNPINNED_SCHEDULERS
+to leave placement to the kernel.
+ */
+void schedule_hybrid_threads(int num_pthreads) {
+    if(num_pthreads < 1 || num_pthreads > MAX_SCHEDULERS) {
+        printf("can't schedule with %d pthreads (max is %d)\n", num_pthreads, MAX_SCHEDULERS);
+        exit(1);
+    }
+    num_schedulers = num_pthreads;
+    for(int i = 0; i < num_schedulers; i++) {
+        schedulers[i].id = i;
+        schedulers[i].release_after_switch = NULL;
+        schedulers[i].watch_fd = -1;
+        schedulers[i].picks = 0;
+        runq_reset(&schedulers[i].queue);
+        atomic_store(&schedulers[i].inbox, -1);
+    }
+    if(io_epoll_fd < 0) {
+        // kept open for the life of the process
+        io_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        io_kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = IO_KICK_TAG;
+        if(io_epoll_fd < 0 || io_kick_fd < 0 ||
+           epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, io_kick_fd, &event) < 0) {
+            perror("could not set up epoll");
+            exit(1);
+        }
+    }
+
+    if(replaying) {
+        replay_threads();
+        return;
+    }
+
+    // deal the threads created so far out to the schedulers, or to
+    // their homes if they have one
+    int index, next = 0;
+    while((index = runq_take(&unscheduled)) >= 0) {
+        if(thread_home[index] >= 0) {
+            runq_push(&schedulers[thread_home[index] % num_schedulers].queue, index);
+        } else {
+            runq_push(&schedulers[next].queue, index);
+            next = (next + 1) % num_schedulers;
+        }
+    }
+
+    pthread_barrier_init(&schedulers_started, NULL, num_schedulers);
+    for(int i = 0; i < num_schedulers; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+#ifndef UNPINNED_SCHEDULERS
+        pin_scheduler(&attr, i);
+#endif
+        if(pthread_create(&schedulers[i].pthread, &attr, schedule_threads_pthread, &schedulers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    for(int i = 0; i < num_schedulers; i++) {
+        pthread_join(schedulers[i].pthread, NULL);
+    }
+    pthread_barrier_destroy(&schedulers_started);
+    if(recording) {
+        stop_recording();
+    }
+}
+
+/*
+yield
+
+Called within a thread to give its scheduler a chance to run some
+other thread.  The thread usually resumes on the scheduler pthread it
+yielded from, but an idle scheduler may steal it.
+*/
+void yield() {
+    int index = current_thread_index;
+    switch_context(&threads[index], &current_scheduler->context);
+}
+
+/*
+finish_thread
+
+Like yield but also marks the thread as finished so it won't be
+scheduled again.  The scheduler frees the stack once it is safely
+switched off of it.
+*/
+void finish_thread() {
+    int index = current_thread_index;
+    thread_state[index] = FINISHED;
+    switch_context(&threads[index], &current_scheduler->context);
+}
+
+static void wait_queue_lock(uthread_wait_queue* queue) {
+    bool in_thread = current_scheduler != NULL;
+    if(replaying && in_thread) {
+        // before taking the lock, so a held thread never holds it
+        replay_sync();
+    }
+    while(atomic_flag_test_and_set_explicit(&queue->lock, memory_order_acquire)) {
+        // the holder is a scheduler pthread that may have been
+        // descheduled by the OS, so don't burn our whole time slice
+        sched_yield();
+    }
+    if(recording && in_thread) {
+        // while holding it, so the log has each queue's lockers in order
+        record_event(REPLAY_SYNC, 0, thread_serial[current_thread_index]);
+    }
+}
+
+static void wait_queue_unlock(uthread_wait_queue* queue) {
+    atomic_flag_clear_explicit(&queue->lock, memory_order_release);
+}
+
+static void wait_queue_init(uthread_wait_queue* queue) {
+    atomic_flag_clear(&queue->lock);
+    queue->first = -1;
+    queue->last = -1;
+}
+
+/*
+park_thread
+
+Parks the current thread on queue, which the caller has locked.  The
+lock stays held until the scheduler is off this thread's stack, so a
+waker on another pthread can't make the thread runnable before its
+context is completely saved.  Returns once some other thread has
+called wake_one_thread on the queue.
+ */
+static void park_thread(uthread_wait_queue* queue) {
+    int index = current_thread_index;
+    thread_next_waiter[index] = -1;
+    if(queue->last < 0) {
+        queue->first = index;
+    } else {
+        thread_next_waiter[queue->last] = index;
+    }
+    queue->last = index;
+
+    thread_state[index] = WAITING;
+    current_scheduler->release_after_switch = &queue->lock;
+    switch_context(&threads[index], &current_scheduler->context);
+}
+
+// caller must hold queue's lock; returns false if nothing was waiting
+static bool wake_one_thread(uthread_wait_queue* queue) {
+    int index = queue->first;
+    if(index < 0) {
+        return false;
+    }
+    queue->first = thread_next_waiter[index];
+    if(queue->first < 0) {
+        queue->last = -1;
+    }
+    trace(index, TRACE_READY);
+    thread_state[index] = PAUSED;
+    make_runnable(index);
+    return true;
+}
+
+/*
+uthread_mutex
+
+A mutex whose lock parks the calling userspace thread if the mutex is
+held.  Unlock hands the mutex straight to the oldest waiter, so a
+thread that keeps relocking can't starve the others.
+ */
+void uthread_mutex_init(uthread_mutex* mutex) {
+    wait_queue_init(&mutex->waiters);
+    mutex->locked = false;
+}
+
+void uthread_mutex_lock(uthread_mutex* mutex) {
+    wait_queue_lock(&mutex->waiters);
+    if(!mutex->locked) {
+        mutex->locked = true;
+        wait_queue_unlock(&mutex->waiters);
+        return;
+    }
+    // on wakeup we already own the mutex
+    park_thread(&mutex->waiters);
+}
+
+void uthread_mutex_unlock(uthread_mutex* mutex) {
+    wait_queue_lock(&mutex->waiters);
+    if(!wake_one_thread(&mutex->waiters)) {
+        mutex->locked = false;
+    }
+    wait_queue_unlock(&mutex->waiters);
+}
+
+/*
+uthread_cond
+
+A condition variable to use with a uthread_mutex.  As with pthread
+condition variables, always recheck the condition in a loop after
+uthread_cond_wait returns.
+ */
+void uthread_cond_init(uthread_cond* cond) {
+    wait_queue_init(&cond->waiters);
+}
+
+void uthread_cond_wait(uthread_cond* cond, uthread_mutex* mutex) {
+    wait_queue_lock(&cond->waiters);
+    // we're queued on the cond before the mutex is released, so a
+    // signal sent as soon as it is released can't be missed
+    uthread_mutex_unlock(mutex);
+    park_thread(&cond->waiters);
+    uthread_mutex_lock(mutex);
+}
+
+void uthread_cond_signal(uthread_cond* cond) {
+    wait_queue_lock(&cond->waiters);
+    wake_one_thread(&cond->waiters);
+    wait_queue_unlock(&cond->waiters);
+}
+
+void uthread_cond_broadcast(uthread_cond* cond) {
+    wait_queue_lock(&cond->waiters);
+    while(wake_one_thread(&cond->waiters)) {
+    }
+    wait_queue_unlock(&cond->waiters);
+}
+
+/*
+uthread_sem
+
+A counting semaphore.  A post with threads waiting hands the count
+straight to the oldest waiter.
+ */
+void uthread_sem_init(uthread_sem* sem, int value) {
+    wait_queue_init(&sem->waiters);
+    sem->value = value;
+}
+
+void uthread_sem_wait(uthread_sem* sem) {
+    wait_queue_lock(&sem->waiters);
+    if(sem->value > 0) {
+        sem->value--;
+        wait_queue_unlock(&sem->waiters);
+        return;
+    }
+    park_thread(&sem->waiters);
+}
+
+void uthread_sem_post(uthread_sem* sem) {
+    wait_queue_lock(&sem->waiters);
+    if(!wake_one_thread(&sem->waiters)) {
+        sem->value++;
+    }
+    wait_queue_unlock(&sem->waiters);
+}
+
+/*
+wait_for_fd
+
+Parks the current thread until fd is ready for events (EPOLLIN or
+EPOLLOUT).  As with park_thread, the fd is only armed once the
+scheduler is off this thread's stack.
+ */
+static void wait_for_fd(int fd, uint32_t events) {
+    int index = current_thread_index;
+    atomic_fetch_add(&io_waiting, 1);
+    thread_state[index] = WAITING;
+    current_scheduler->watch_fd = fd;
+    current_scheduler->watch_events = events;
+    switch_context(&threads[index], &current_scheduler->context);
+}
+
+static void make_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if(flags >= 0 && !(flags & O_NONBLOCK)) {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+}
+
+/*
+uthread_read
+
+Works like read, but if there's nothing to read yet only the calling
+thread waits - its scheduler pthread goes on running other threads.
+Meant for pipes, sockets and other fds epoll can watch (regular files
+never make read wait anyway).  fd is switched to non-blocking mode.
+Only one thread at a time should be waiting on any one fd.
+ */
+ssize_t uthread_read(int fd, void* buf, size_t count) {
+    make_nonblocking(fd);
+    while(1) {
+        sync_point();
+        ssize_t result = read(fd, buf, count);
+        if(result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return result;
+        }
+        wait_for_fd(fd, EPOLLIN);
+    }
+}
+
+/*
+uthread_write
+
+The write counterpart of uthread_read.  Like write, it may write less
+than count bytes.
+ */
+ssize_t uthread_write(int fd, const void* buf, size_t count) {
+    make_nonblocking(fd);
+    while(1) {
+        sync_point();
+        ssize_t result = write(fd, buf, count);
+        if(result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return result;
+        }
+        wait_for_fd(fd, EPOLLOUT);
+    }
+}
+
+/*
+uthread_trace_start
+
+Starts recording every time a thread is switched in or out, or
+becomes ready to run, throwing away anything recorded before.  Each
+scheduler pthread writes its events to its own ring (see
+uthread_trace.h), so tracing takes no locks and adds no sharing
+between schedulers.  Call it after initialize_basic_threads and
+before schedule_hybrid_threads, and uthread_trace_stop once
+schedule_hybrid_threads has returned - the rings are only safe to read
+once the schedulers are done with them.
+
+uthread_trace_stats fills in stats for one thread (numbered in
+creation order from 0) and returns false if the trace has nothing on
+it: how many times it was switched in, its CPU time, and how long it
+waited runnable for a scheduler.  uthread_trace_summary prints that
+for every thread, and for each scheduler pthread how much of its time
+went to running threads.  uthread_trace_write_json writes a Chrome
+trace to path with a row per scheduler pthread, to look at in
+chrome://tracing or ui.perfetto.dev.
+
+Example usage:
+
+initialize_basic_threads();
+create_new_thread(work);
+uthread_trace_start();
+schedule_hybrid_threads(4);
+uthread_trace_stop();
+uthread_trace_summary();
+uthread_trace_write_json("trace.json");
+ */
+void uthread_trace_start() {
+    for(int i = 0; i <= MAX_SCHEDULERS; i++) {
+        trace_rings[i].count = 0;
+    }
+    trace_calibrate(&trace_calibration, true);
+    tracing = true;
+}
+
+void uthread_trace_stop() {
+    tracing = false;
+    trace_calibrate(&trace_calibration, false);
+}
+
+bool uthread_trace_stats(int thread, uthread_stats* stats) {
+    int num_threads;
+    struct trace_stats* all = trace_collect_stats(trace_rings, MAX_SCHEDULERS + 1, &num_threads);
+    bool found = thread >= 0 && thread < num_threads && all[thread].switches > 0;
+    if(found) {
+        stats->switches = all[thread].switches;
+        stats->cpu_us = all[thread].run_tsc / trace_calibration.tsc_per_us;
+        stats->wait_us = all[thread].wait_tsc / trace_calibration.tsc_per_us;
+    }
+    free(all);
+    return found;
+}
+
+void uthread_trace_summary() {
+    trace_print_summary(stdout, trace_rings, MAX_SCHEDULERS + 1, &trace_calibration);
+}
+
+bool uthread_trace_write_json(const char* path) {
+    return trace_write_chrome_json(path, trace_rings, MAX_SCHEDULERS + 1, &trace_calibration);
+}
+
+/*
+uthread_record
+
+Records the next schedule_hybrid_threads run to the file at path:
+every time a scheduler pthread claims a thread, every thread creation,
+and every time a thread synchronizes.  Call it after
+initialize_basic_threads and before creating any threads.  Recording
+costs one atomic add and an 8 byte store per event, and the log is
+written as it goes, so it survives a crash.
+Up to REPLAY_MAX_EVENTS events are kept.
+
+uthread_replay reads a log and makes the next schedule_hybrid_threads
+run the threads in the same order, on one pthread, however many it
+is asked for.  Call it where uthread_record was called, with the
+program otherwise doing the same things.  Turns that overlapped on
+different CPUs are interleaved at their synchronization points - the
+uthread_mutex, uthread_cond and uthread_sem calls and each
+uthread_read or uthread_write attempt - in the order those happened.
+So threads that only share data through those do the same as when
+recorded.  Anything else shared (plain variables, atomics, other
+I/O) may read differently, and so may the results of I/O between
+threads, since the log can't order an I/O call against the other
+end's exactly.  If the program does anything the log doesn't match,
+replay exits saying where.
+
+Example usage:
+
+initialize_basic_threads();
+if(argc > 1) {
+    uthread_replay(argv[1]);
+} else {
+    uthread_record("soak.log");
+}
+create_new_thread(client);
+create_new_thread(server);
+schedule_hybrid_threads(8);
+ */
+void uthread_record(const char* path) {
+    size_t size = sizeof(struct replay_header) + REPLAY_MAX_EVENTS * sizeof(struct replay_event);
+    record_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    // the file is sparse until events are written
+    if(record_fd < 0 || ftruncate(record_fd, size) < 0) {
+        perror(path);
+        exit(1);
+    }
+    record_header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, record_fd, 0);
+    if(record_header == MAP_FAILED) {
+        perror("mmap replay log");
+        exit(1);
+    }
+    memcpy(record_header->magic, REPLAY_MAGIC, sizeof record_header->magic);
+    atomic_store(&record_header->count, 0);
+    record_events = (struct replay_event*) (record_header + 1);
+    snprintf(record_path, sizeof record_path, "%s", path);
+    recording = true;
+}
+
+void uthread_replay(const char* path) {
+    FILE* in = fopen(path, "r");
+    struct replay_header header;
+    if(in == NULL || fread(&header, sizeof header, 1, in) != 1 ||
+       memcmp(header.magic, REPLAY_MAGIC, sizeof header.magic) != 0) {
+        printf("%s is not a replay log\n", path);
+        exit(1);
+    }
+    size_t count = atomic_load(&header.count);
+    if(count > REPLAY_MAX_EVENTS) {
+        count = REPLAY_MAX_EVENTS;
+    }
+    replay_events = malloc((count + 1) * sizeof *replay_events);
+    if(replay_events == NULL) {
+        printf("could not malloc the replay log\n");
+        exit(1);
+    }
+    // a crash can leave the count ahead of what was written
+    replay_count = fread(replay_events, sizeof *replay_events, count, in);
+    fclose(in);
+    replay_max_serial = 0;
+    for(size_t i = 0; i < replay_count; i++) {
+        if(REPLAY_TYPE(replay_events[i].what) == 0) {
+            replay_count = i;
+            break;
+        }
+        if(replay_events[i].thread > replay_max_serial) {
+            replay_max_serial = replay_events[i].thread;
+        }
+    }
+
+    replay_slot = malloc((replay_max_serial + 1) * sizeof *replay_slot);
+    replay_first_child = malloc((replay_max_serial + 2) * sizeof *replay_first_child);
+    replay_next_child = malloc((replay_count + 1) * sizeof *replay_next_child);
+    if(replay_slot == NULL || replay_first_child == NULL || replay_next_child == NULL) {
+        printf("could not malloc the replay log\n");
+        exit(1);
+    }
+    for(uint32_t i = 0; i <= replay_max_serial; i++) {
+        replay_slot[i] = -1;
+    }
+    for(uint32_t i = 0; i <= replay_max_serial + 1; i++) {
+        replay_first_child[i] = -1;
+    }
+    // backwards, so each creator's list ends up oldest first
+    for(size_t i = replay_count; i-- > 0;) {
+        uint32_t what = replay_events[i].what;
+        if(REPLAY_TYPE(what) == REPLAY_CREATE && REPLAY_DETAIL(what) <= replay_max_serial + 1) {
+            replay_next_child[i] = replay_first_child[REPLAY_DETAIL(what)];
+            replay_first_child[REPLAY_DETAIL(what)] = i;
+        }
+    }
+    replay_next = 0;
+    replaying = true;
+}
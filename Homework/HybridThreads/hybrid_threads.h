@@ -9,6 +9,9 @@ these functions in the .c file rather than the header.
 You should not need to modify this header.
 
  */
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
 
 void initialize_basic_threads();
 
@@ -16,8 +19,83 @@ void create_new_thread(void (*fun_ptr)());
 
 void create_new_parameterized_thread(void (*fun_ptr)(void*), void* parameter);
 
+void create_new_threads_bulk(void (*fun_ptr)(void*), void* parameters[], int n);
+
+void create_new_affine_thread(void (*fun_ptr)(void*), void* parameter, int scheduler);
+
+int current_scheduler_id();
+
 void schedule_hybrid_threads(int num_pthreads);
 
 void yield();
 
 void finish_thread();
+
+/*
+Synchronization for userspace threads.  Unlike a sem_t or a
+pthread_mutex_t, waiting on one of these parks only the calling
+userspace thread - its scheduler pthread moves on to another thread.
+They must only be waited on from inside userspace threads.
+ */
+
+// the threads parked on a primitive, oldest first
+typedef struct {
+    atomic_flag lock;
+    int first;
+    int last;
+} uthread_wait_queue;
+
+typedef struct {
+    uthread_wait_queue waiters;
+    bool locked;
+} uthread_mutex;
+
+typedef struct {
+    uthread_wait_queue waiters;
+} uthread_cond;
+
+typedef struct {
+    uthread_wait_queue waiters;
+    int value;
+} uthread_sem;
+
+void uthread_mutex_init(uthread_mutex* mutex);
+void uthread_mutex_lock(uthread_mutex* mutex);
+void uthread_mutex_unlock(uthread_mutex* mutex);
+
+void uthread_cond_init(uthread_cond* cond);
+void uthread_cond_wait(uthread_cond* cond, uthread_mutex* mutex);
+void uthread_cond_signal(uthread_cond* cond);
+void uthread_cond_broadcast(uthread_cond* cond);
+
+void uthread_sem_init(uthread_sem* sem, int value);
+void uthread_sem_wait(uthread_sem* sem);
+void uthread_sem_post(uthread_sem* sem);
+
+/*
+I/O for userspace threads: like read and write, but waiting parks
+only the calling userspace thread.
+ */
+ssize_t uthread_read(int fd, void* buf, size_t count);
+ssize_t uthread_write(int fd, const void* buf, size_t count);
+
+/*
+Tracing (see uthread_trace_start in hybrid_threads.c).  Threads are
+numbered in the order they were created, from 0 after each
+initialize_basic_threads.
+ */
+typedef struct {
+    long switches;
+    double cpu_us;
+    double wait_us;
+} uthread_stats;
+
+void uthread_trace_start();
+void uthread_trace_stop();
+bool uthread_trace_stats(int thread, uthread_stats* stats);
+void uthread_trace_summary();
+bool uthread_trace_write_json(const char* path);
+
+// record a run's scheduling to a file, or replay one (see uthread_record)
+void uthread_record(const char* path);
+void uthread_replay(const char* path);
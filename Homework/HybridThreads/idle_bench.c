@@ -0,0 +1,109 @@
+/*
+idle_bench - what idle scheduler pthreads cost, and how fast a sleeping
+one picks up new work
+
+"low load" runs a single thread that sleeps in usleep (blocking its
+scheduler pthread, like a thread doing I/O would) on 8 schedulers.  The
+other 7 have nothing to do, so the CPU time used beyond the sleeping
+thread's own is what idling costs.
+
+"wake latency" has a thread create a child and then block its own
+pthread in usleep, so the child can only start promptly if another
+scheduler is woken to steal it.  The reported time is from
+create_new_thread to the child's first instruction.
+
+    make idle_bench idle_bench_spin
+    ./idle_bench
+    ./idle_bench_spin
+
+idle_bench_spin is built with SPIN_IDLE_SCHEDULERS, so idle schedulers
+busy wait with sched_yield instead of sleeping on a futex.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "hybrid_threads.h"
+
+#define NUM_SCHEDULERS 8
+#define SLEEPS 200
+#define SLEEP_US 1000
+#define WAKES 500
+
+double create_time;
+double wake_latency[WAKES];
+atomic_bool child_started;
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+void mostly_sleeping_thread()
+{
+    for(int i = 0; i < SLEEPS; i++) {
+        usleep(SLEEP_US);
+        yield();
+    }
+}
+
+void woken_child(void* parameter)
+{
+    long i = (long) parameter;
+    wake_latency[i] = now_seconds() - create_time;
+    atomic_store(&child_started, true);
+}
+
+void creating_parent()
+{
+    for(long i = 0; i < WAKES; i++) {
+        atomic_store(&child_started, false);
+        create_time = now_seconds();
+        create_new_parameterized_thread(woken_child, (void*) i);
+        // keep our pthread busy so someone else has to run the child
+        usleep(SLEEP_US);
+        while(!atomic_load(&child_started)) {
+            yield();
+        }
+    }
+}
+
+int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+
+    initialize_basic_threads();
+    create_new_thread(mostly_sleeping_thread);
+    double start_wall = now_seconds();
+    double start_cpu = cpu_seconds();
+    schedule_hybrid_threads(NUM_SCHEDULERS);
+    double wall = now_seconds() - start_wall;
+    double cpu = cpu_seconds() - start_cpu;
+    printf("low load:     %.3f s wall, %.3f s cpu (%.0f%% of one core)\n",
+           wall, cpu, cpu * 100 / wall);
+
+    initialize_basic_threads();
+    create_new_thread(creating_parent);
+    schedule_hybrid_threads(NUM_SCHEDULERS);
+    qsort(wake_latency, WAKES, sizeof *wake_latency, compare_doubles);
+    printf("wake latency: median %.1f us, 90th %.1f us, max %.1f us\n",
+           wake_latency[WAKES / 2] * 1e6, wake_latency[WAKES * 9 / 10] * 1e6,
+           wake_latency[WAKES - 1] * 1e6);
+}
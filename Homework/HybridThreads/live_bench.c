@@ -0,0 +1,132 @@
+/*
+live_bench - what creating and yielding cost with thousands of live
+threads around
+
+Most of the threads wait on a uthread_sem the whole time, holding the
+lowest slots.  Meanwhile one thread creates short lived children one
+at a time and times just its create calls, and two more yield back
+and forth.  Free slots are popped off a stack and runnable threads
+come off run queues, so neither should slow down as the number of
+waiting threads grows.
+
+    make live_bench
+    ./live_bench
+
+The number of live threads is limited by MAX_THREADS in
+hybrid_threads.c.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "hybrid_threads.h"
+
+#define CHILDREN 20000
+#define YIELDS 20000
+
+uthread_sem waiting_sem;
+int num_waiting;
+atomic_int waiting_started;
+atomic_int children_done;
+atomic_int busy_threads_done;
+long create_ns;
+long yield_ns;
+
+long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void wait_for_the_end()
+{
+    atomic_fetch_add(&waiting_started, 1);
+    uthread_sem_wait(&waiting_sem);
+}
+
+void child()
+{
+    atomic_fetch_add(&children_done, 1);
+}
+
+// waits for every waiter to be parked so they really hold their slots
+void wait_for_waiters()
+{
+    while(atomic_load(&waiting_started) < num_waiting) {
+        yield();
+    }
+}
+
+void create_children()
+{
+    wait_for_waiters();
+    for(int i = 0; i < CHILDREN; i++) {
+        long start = now_ns();
+        create_new_thread(child);
+        create_ns += now_ns() - start;
+        yield();
+    }
+    atomic_fetch_add(&busy_threads_done, 1);
+}
+
+void yield_a_lot()
+{
+    wait_for_waiters();
+    long start = now_ns();
+    for(int i = 0; i < YIELDS; i++) {
+        yield();
+    }
+    __atomic_fetch_add(&yield_ns, now_ns() - start, __ATOMIC_RELAXED);
+    atomic_fetch_add(&busy_threads_done, 1);
+}
+
+void release_waiters()
+{
+    while(atomic_load(&busy_threads_done) < 3) {
+        yield();
+    }
+    for(int i = 0; i < num_waiting; i++) {
+        uthread_sem_post(&waiting_sem);
+    }
+}
+
+void run(int schedulers, int live)
+{
+    num_waiting = live;
+    atomic_store(&waiting_started, 0);
+    atomic_store(&children_done, 0);
+    atomic_store(&busy_threads_done, 0);
+    create_ns = 0;
+    yield_ns = 0;
+    initialize_basic_threads();
+    uthread_sem_init(&waiting_sem, 0);
+    create_new_threads_bulk((void (*)(void*)) wait_for_the_end, NULL, live);
+    create_new_thread(create_children);
+    create_new_thread(yield_a_lot);
+    create_new_thread(yield_a_lot);
+    create_new_thread(release_waiters);
+    schedule_hybrid_threads(schedulers);
+    if(atomic_load(&children_done) != CHILDREN) {
+        printf("expected %d children to finish but %d did\n", CHILDREN, atomic_load(&children_done));
+        exit(1);
+    }
+    // each yielder's time covers all of its yields
+    printf("%10d %10d %14.0f %14.0f\n", schedulers, live, (double) create_ns / CHILDREN,
+           (double) yield_ns / (2.0 * YIELDS));
+}
+
+int main(int argc, char *argv[]) {
+
+    int scheduler_counts[] = {1, 4};
+    int live_counts[] = {10, 1000, 10000};
+    int num_schedulers = sizeof scheduler_counts / sizeof *scheduler_counts;
+    int num_lives = sizeof live_counts / sizeof *live_counts;
+
+    printf("%10s %10s %14s %14s\n", "pthreads", "waiting", "ns/create", "ns/yield");
+    for(int i = 0; i < num_schedulers; i++) {
+        for(int j = 0; j < num_lives; j++) {
+            run(scheduler_counts[i], live_counts[j]);
+        }
+    }
+}
@@ -0,0 +1,175 @@
+/*
+pipe_echo_bench - round trips per second through pipes, with user
+threads doing their I/O via uthread_read/uthread_write
+
+Each pair is a client and an echo server connected by two pipes.  The
+client writes a message, the server reads it and writes it back, and
+the client reads the echo.  Every read has to wait for the other side,
+so with plain read() a scheduler pthread would block on the first one.
+
+For comparison the same pairs are also run with one pthread per
+client and server doing blocking read/write.
+
+    make pipe_echo_bench
+    ./pipe_echo_bench
+
+The number of pairs is limited by MAX_THREADS in hybrid_threads.c.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "hybrid_threads.h"
+
+#define NUM_PAIRS 45
+#define ROUND_TRIPS 2000
+#define MESSAGE_SIZE 64
+
+struct pair {
+    int to_server[2];
+    int to_client[2];
+};
+
+struct pair pairs[NUM_PAIRS];
+
+// blocking or not is up to these
+ssize_t (*do_read)(int fd, void* buf, size_t count);
+ssize_t (*do_write)(int fd, const void* buf, size_t count);
+
+void read_fully(int fd, char* buf, size_t count)
+{
+    size_t done = 0;
+    while(done < count) {
+        ssize_t n = do_read(fd, buf + done, count - done);
+        if(n <= 0) {
+            perror("read");
+            exit(1);
+        }
+        done += n;
+    }
+}
+
+void write_fully(int fd, const char* buf, size_t count)
+{
+    size_t done = 0;
+    while(done < count) {
+        ssize_t n = do_write(fd, buf + done, count - done);
+        if(n <= 0) {
+            perror("write");
+            exit(1);
+        }
+        done += n;
+    }
+}
+
+void client(void* arg)
+{
+    struct pair* p = arg;
+    char message[MESSAGE_SIZE], echo[MESSAGE_SIZE];
+    memset(message, 'x', MESSAGE_SIZE);
+    for(int i = 0; i < ROUND_TRIPS; i++) {
+        message[0] = i;
+        write_fully(p->to_server[1], message, MESSAGE_SIZE);
+        read_fully(p->to_client[0], echo, MESSAGE_SIZE);
+        if(echo[0] != message[0]) {
+            printf("echo came back wrong\n");
+            exit(1);
+        }
+    }
+}
+
+void server(void* arg)
+{
+    struct pair* p = arg;
+    char message[MESSAGE_SIZE];
+    for(int i = 0; i < ROUND_TRIPS; i++) {
+        read_fully(p->to_server[0], message, MESSAGE_SIZE);
+        write_fully(p->to_client[1], message, MESSAGE_SIZE);
+    }
+}
+
+void* client_pthread(void* arg)
+{
+    client(arg);
+    return NULL;
+}
+
+void* server_pthread(void* arg)
+{
+    server(arg);
+    return NULL;
+}
+
+void open_pipes()
+{
+    for(int i = 0; i < NUM_PAIRS; i++) {
+        if(pipe(pairs[i].to_server) < 0 || pipe(pairs[i].to_client) < 0) {
+            perror("pipe");
+            exit(1);
+        }
+    }
+}
+
+void close_pipes()
+{
+    for(int i = 0; i < NUM_PAIRS; i++) {
+        close(pairs[i].to_server[0]);
+        close(pairs[i].to_server[1]);
+        close(pairs[i].to_client[0]);
+        close(pairs[i].to_client[1]);
+    }
+}
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(const char* how, int pthreads, double elapsed)
+{
+    double trips = (double) NUM_PAIRS * ROUND_TRIPS;
+    printf("%-22s %10d %10.3f %14.0f\n", how, pthreads, elapsed, trips / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+
+    int scheduler_counts[] = {1, 2, 4, 8};
+    int num_counts = sizeof scheduler_counts / sizeof *scheduler_counts;
+
+    printf("%d pairs, %d round trips of %d bytes each\n", NUM_PAIRS, ROUND_TRIPS, MESSAGE_SIZE);
+    printf("%-22s %10s %10s %14s\n", "", "pthreads", "seconds", "round trips/s");
+
+    do_read = uthread_read;
+    do_write = uthread_write;
+    for(int i = 0; i < num_counts; i++) {
+        open_pipes();
+        initialize_basic_threads();
+        for(int j = 0; j < NUM_PAIRS; j++) {
+            create_new_parameterized_thread(server, &pairs[j]);
+            create_new_parameterized_thread(client, &pairs[j]);
+        }
+        double start = now_seconds();
+        schedule_hybrid_threads(scheduler_counts[i]);
+        report("user threads", scheduler_counts[i], now_seconds() - start);
+        close_pipes();
+    }
+
+    do_read = read;
+    do_write = write;
+    open_pipes();
+    pthread_t pthreads[2 * NUM_PAIRS];
+    double start = now_seconds();
+    for(int j = 0; j < NUM_PAIRS; j++) {
+        pthread_create(&pthreads[2 * j], NULL, server_pthread, &pairs[j]);
+        pthread_create(&pthreads[2 * j + 1], NULL, client_pthread, &pairs[j]);
+    }
+    for(int j = 0; j < 2 * NUM_PAIRS; j++) {
+        pthread_join(pthreads[j], NULL);
+    }
+    report("pthread per thread", 2 * NUM_PAIRS, now_seconds() - start);
+    close_pipes();
+}
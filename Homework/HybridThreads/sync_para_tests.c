@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "hybrid_threads.h"
+#include "CuTest.h"
+
+int count;
+
+uthread_mutex mutex;
+uthread_cond cond;
+uthread_sem sem;
+
+void add_100_to_count_yielding_while_locked()
+{
+    for(int i = 0; i < 100; i++) {
+        uthread_mutex_lock(&mutex);
+        int old = count;
+        // with a sem_t this yield would leave the lock held by a
+        // paused thread, and any other thread that tried to take it
+        // would block its whole scheduler pthread
+        yield();
+        count = old + 1;
+        uthread_mutex_unlock(&mutex);
+    }
+}
+
+void test_mutex_one_scheduler(CuTest *tc) {
+    count = 0;
+    initialize_basic_threads();
+    uthread_mutex_init(&mutex);
+    for(int i = 0; i < 5; i++) {
+        create_new_thread(add_100_to_count_yielding_while_locked);
+    }
+    schedule_hybrid_threads(1);
+    CuAssertIntEquals(tc, 500, count);
+}
+
+void test_mutex_many_schedulers(CuTest *tc) {
+    count = 0;
+    initialize_basic_threads();
+    uthread_mutex_init(&mutex);
+    for(int i = 0; i < 20; i++) {
+        create_new_thread(add_100_to_count_yielding_while_locked);
+    }
+    schedule_hybrid_threads(4);
+    CuAssertIntEquals(tc, 2000, count);
+}
+
+void wait_for_post()
+{
+    uthread_sem_wait(&sem);
+    count = count + 10;
+}
+
+void post_after_yield()
+{
+    yield();
+    count = count + 1;
+    uthread_sem_post(&sem);
+}
+
+void test_sem_only_blocks_the_user_thread(CuTest *tc) {
+    count = 0;
+    initialize_basic_threads();
+    uthread_sem_init(&sem, 0);
+    // waiter runs first and would deadlock a lone scheduler pthread if
+    // it blocked the pthread rather than just itself
+    create_new_thread(wait_for_post);
+    create_new_thread(post_after_yield);
+    schedule_hybrid_threads(1);
+    CuAssertIntEquals(tc, 11, count);
+}
+
+void add_10_to_count_with_sem()
+{
+    for(int i = 0; i < 10; i++) {
+        uthread_sem_wait(&sem);
+        int old = count;
+        yield();
+        count = old + 1;
+        uthread_sem_post(&sem);
+    }
+}
+
+void make_25_sem_threads()
+{
+    for(int i = 0; i < 25; i++) {
+        create_new_thread(add_10_to_count_with_sem);
+    }
+}
+
+void test_sem_create_a_lot(CuTest *tc) {
+    count = 0;
+    initialize_basic_threads();
+    uthread_sem_init(&sem, 1);
+    for(int i = 0; i < 3; i++) {
+        create_new_thread(make_25_sem_threads);
+    }
+    schedule_hybrid_threads(3);
+    CuAssertIntEquals(tc, 750, count);
+}
+
+#define BUFFER_SIZE 2
+#define ITEMS 200
+#define CONSUMERS 4
+
+int buffer[BUFFER_SIZE];
+int buffer_count;
+int consumed_sum;
+int consumed_items;
+
+void producer()
+{
+    for(int i = 1; i <= ITEMS; i++) {
+        uthread_mutex_lock(&mutex);
+        while(buffer_count == BUFFER_SIZE) {
+            uthread_cond_wait(&cond, &mutex);
+        }
+        buffer[buffer_count++] = i;
+        uthread_cond_broadcast(&cond);
+        uthread_mutex_unlock(&mutex);
+    }
+}
+
+void consumer()
+{
+    while(1) {
+        uthread_mutex_lock(&mutex);
+        while(buffer_count == 0 && consumed_items < ITEMS) {
+            uthread_cond_wait(&cond, &mutex);
+        }
+        if(consumed_items == ITEMS) {
+            uthread_mutex_unlock(&mutex);
+            return;
+        }
+        consumed_sum += buffer[--buffer_count];
+        consumed_items++;
+        // wakes the producer, and the other consumers once we're done
+        uthread_cond_broadcast(&cond);
+        uthread_mutex_unlock(&mutex);
+        yield();
+    }
+}
+
+void test_cond_producer_consumer(CuTest *tc) {
+    buffer_count = 0;
+    consumed_sum = 0;
+    consumed_items = 0;
+    initialize_basic_threads();
+    uthread_mutex_init(&mutex);
+    uthread_cond_init(&cond);
+    for(int i = 0; i < CONSUMERS; i++) {
+        create_new_thread(consumer);
+    }
+    create_new_thread(producer);
+    schedule_hybrid_threads(2);
+    CuAssertIntEquals(tc, ITEMS, consumed_items);
+    CuAssertIntEquals(tc, ITEMS * (ITEMS + 1) / 2, consumed_sum);
+}
+
+int pipe_fds[2];
+char received[16];
+
+void read_from_empty_pipe()
+{
+    // with a plain read this would block the only scheduler pthread
+    // and the writer below would never get to run
+    ssize_t n = uthread_read(pipe_fds[0], received, sizeof received);
+    if(n > 0) {
+        count = count + n;
+    }
+}
+
+void write_to_pipe()
+{
+    yield();
+    count = count + 100;
+    uthread_write(pipe_fds[1], "hello", 5);
+}
+
+void test_read_only_blocks_the_user_thread(CuTest *tc) {
+    count = 0;
+    if(pipe(pipe_fds) < 0) {
+        CuFail(tc, "could not make a pipe");
+    }
+    initialize_basic_threads();
+    create_new_thread(read_from_empty_pipe);
+    create_new_thread(write_to_pipe);
+    schedule_hybrid_threads(1);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    CuAssertIntEquals(tc, 105, count);
+    CuAssertTrue(tc, memcmp(received, "hello", 5) == 0);
+}
+
+void test_trace_counts_switches(CuTest *tc) {
+    count = 0;
+    initialize_basic_threads();
+    uthread_sem_init(&sem, 0);
+    create_new_thread(wait_for_post);
+    create_new_thread(post_after_yield);
+    uthread_trace_start();
+    schedule_hybrid_threads(1);
+    uthread_trace_stop();
+    CuAssertIntEquals(tc, 11, count);
+    uthread_stats stats;
+    // blocked on the sem, then run again once posted
+    CuAssertTrue(tc, uthread_trace_stats(0, &stats));
+    CuAssertIntEquals(tc, 2, stats.switches);
+    CuAssertTrue(tc, stats.wait_us > 0);
+    // yielded once
+    CuAssertTrue(tc, uthread_trace_stats(1, &stats));
+    CuAssertIntEquals(tc, 2, stats.switches);
+    CuAssertTrue(tc, stats.cpu_us > 0);
+    CuAssertTrue(tc, !uthread_trace_stats(2, &stats));
+}
+
+#define ORDER_THREADS 8
+#define ORDER_TURNS 20
+
+int order[ORDER_THREADS * ORDER_TURNS];
+int order_count;
+
+void note_turns_in_order(void* id)
+{
+    for(int i = 0; i < ORDER_TURNS; i++) {
+        uthread_mutex_lock(&mutex);
+        order[order_count++] = (long) id;
+        uthread_mutex_unlock(&mutex);
+        yield();
+    }
+}
+
+// the order the threads got the mutex in, which depends on how the
+// schedulers interleaved them
+void run_order_threads(int* result)
+{
+    order_count = 0;
+    uthread_mutex_init(&mutex);
+    for(long i = 0; i < ORDER_THREADS; i++) {
+        create_new_parameterized_thread(note_turns_in_order, (void*) i);
+    }
+    schedule_hybrid_threads(4);
+    memcpy(result, order, sizeof order);
+}
+
+void test_replay_repeats_the_recorded_order(CuTest *tc) {
+    int recorded[ORDER_THREADS * ORDER_TURNS];
+    int replayed[ORDER_THREADS * ORDER_TURNS];
+    char path[] = "/tmp/sync_para_testsXXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        CuFail(tc, "could not make a temporary file");
+    }
+    close(fd);
+
+    initialize_basic_threads();
+    uthread_record(path);
+    run_order_threads(recorded);
+    CuAssertIntEquals(tc, ORDER_THREADS * ORDER_TURNS, order_count);
+
+    initialize_basic_threads();
+    uthread_replay(path);
+    run_order_threads(replayed);
+    unlink(path);
+    CuAssertIntEquals(tc, ORDER_THREADS * ORDER_TURNS, order_count);
+    CuAssertTrue(tc, memcmp(recorded, replayed, sizeof recorded) == 0);
+}
+
+int main(int argc, char *argv[]) {
+
+    CuString *output = CuStringNew();
+    CuSuite* suite = CuSuiteNew();
+
+    SUITE_ADD_TEST(suite, test_mutex_one_scheduler);
+    SUITE_ADD_TEST(suite, test_mutex_many_schedulers);
+    SUITE_ADD_TEST(suite, test_sem_only_blocks_the_user_thread);
+    SUITE_ADD_TEST(suite, test_sem_create_a_lot);
+    SUITE_ADD_TEST(suite, test_cond_producer_consumer);
+    SUITE_ADD_TEST(suite, test_read_only_blocks_the_user_thread);
+    SUITE_ADD_TEST(suite, test_trace_counts_switches);
+    SUITE_ADD_TEST(suite, test_replay_repeats_the_recorded_order);
+
+    CuSuiteRun(suite);
+    CuSuiteSummary(suite, output);
+    CuSuiteDetails(suite, output);
+    printf("%s\n", output->buffer);
+    CuStringDelete(output);
+    CuSuiteDelete(suite);
+}
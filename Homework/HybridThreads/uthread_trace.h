@@ -0,0 +1,291 @@
+/*
+uthread_trace.h - scheduler tracing for the thread libraries
+
+Every scheduler pthread records what it does to its own ring of
+events: a thread becoming ready to run, being switched in, and being
+switched out (still runnable, blocked or finished).  Only the owning
+pthread ever writes a ring, so recording is a timestamp and three
+stores - no locks and no atomics.  A full ring overwrites its oldest
+events.  Rings are only read once scheduling is over.
+
+Timestamps come from rdtsc.  trace_calibrate measures the TSC against
+CLOCK_MONOTONIC so the readers can report microseconds.
+
+From the rings, trace_collect_stats works out each thread's CPU time,
+how long it sat runnable waiting for a scheduler, and how many times
+it was switched in.  trace_print_summary prints those plus how much
+of each scheduler's time went to running threads.
+trace_write_chrome_json writes the Chrome trace event format, which
+chrome://tracing and https://ui.perfetto.dev show as a timeline with
+one row per scheduler pthread.
+
+Everything is static so each threads library can include this without
+another file to link.
+ */
+#ifndef UTHREAD_TRACE_H
+#define UTHREAD_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+// events per ring, a power of 2
+#define TRACE_RING_EVENTS (1 << 16)
+
+#define TRACE_READY 0
+#define TRACE_RUN 1
+// switched out but still runnable (a yield)
+#define TRACE_STOP 2
+// switched out to wait for something
+#define TRACE_BLOCK 3
+#define TRACE_EXIT 4
+
+struct trace_event {
+    uint64_t tsc;
+    uint32_t thread;
+    uint32_t type;
+};
+
+struct trace_ring {
+    // each ring on its own cache line, as their owners write them at
+    // the same time
+    _Alignas(64) struct trace_event* events;
+    // events ever recorded; the newest TRACE_RING_EVENTS are kept
+    uint64_t count;
+};
+
+struct trace_stats {
+    uint64_t run_tsc;
+    uint64_t wait_tsc;
+    uint64_t switches;
+    // scratch for trace_collect_stats
+    uint64_t ready_since;
+    uint64_t running_since;
+};
+
+struct trace_calibration {
+    uint64_t tsc;
+    long long ns;
+    double tsc_per_us;
+};
+
+static inline uint64_t trace_clock() {
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void trace_record(struct trace_ring* ring, uint32_t thread, uint32_t type) {
+    if(ring->events == NULL) {
+        ring->events = malloc(TRACE_RING_EVENTS * sizeof *ring->events);
+        if(ring->events == NULL) {
+            printf("could not malloc a trace ring\n");
+            exit(1);
+        }
+    }
+    struct trace_event* event = &ring->events[ring->count & (TRACE_RING_EVENTS - 1)];
+    event->tsc = trace_clock();
+    event->thread = thread;
+    event->type = type;
+    ring->count++;
+}
+
+static inline long long trace_monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// call once when tracing starts and again before reading the rings;
+// the TSC rate is measured over the time in between
+static void trace_calibrate(struct trace_calibration* c, bool starting) {
+    uint64_t tsc = trace_clock();
+    long long ns = trace_monotonic_ns();
+    if(starting) {
+        c->tsc = tsc;
+        c->ns = ns;
+        c->tsc_per_us = 0;
+    } else if(ns > c->ns) {
+        c->tsc_per_us = (tsc - c->tsc) * 1000.0 / (ns - c->ns);
+    }
+    if(c->tsc_per_us <= 0) {
+        // no time has passed to measure over
+        c->tsc_per_us = 1000;
+    }
+}
+
+static uint64_t trace_first_kept(struct trace_ring* ring) {
+    return ring->count > TRACE_RING_EVENTS ? ring->count - TRACE_RING_EVENTS : 0;
+}
+
+static int trace_by_time(const void* a, const void* b) {
+    uint64_t x = ((const struct trace_event*) a)->tsc, y = ((const struct trace_event*) b)->tsc;
+    return (x > y) - (x < y);
+}
+
+// events from every ring, sorted by time
+static struct trace_event* trace_merge(struct trace_ring* rings, int num_rings, size_t* total) {
+    *total = 0;
+    for(int r = 0; r < num_rings; r++) {
+        *total += rings[r].count - trace_first_kept(&rings[r]);
+    }
+    struct trace_event* all = malloc((*total + 1) * sizeof *all);
+    if(all == NULL) {
+        printf("could not malloc the merged trace\n");
+        exit(1);
+    }
+    size_t n = 0;
+    for(int r = 0; r < num_rings; r++) {
+        for(uint64_t i = trace_first_kept(&rings[r]); i < rings[r].count; i++) {
+            all[n++] = rings[r].events[i & (TRACE_RING_EVENTS - 1)];
+        }
+    }
+    qsort(all, n, sizeof *all, trace_by_time);
+    return all;
+}
+
+/*
+trace_collect_stats
+
+Returns a malloced array of stats indexed by thread id, and sets
+*num_threads to its length.  If a ring has wrapped, the threads' early
+history is missing from their totals.
+ */
+static struct trace_stats* trace_collect_stats(struct trace_ring* rings, int num_rings, int* num_threads) {
+    size_t total;
+    struct trace_event* all = trace_merge(rings, num_rings, &total);
+    uint32_t max_thread = 0;
+    for(size_t i = 0; i < total; i++) {
+        if(all[i].thread > max_thread) {
+            max_thread = all[i].thread;
+        }
+    }
+    *num_threads = total == 0 ? 0 : max_thread + 1;
+    struct trace_stats* stats = calloc(*num_threads + 1, sizeof *stats);
+    if(stats == NULL) {
+        printf("could not malloc trace stats\n");
+        exit(1);
+    }
+    for(size_t i = 0; i < total; i++) {
+        struct trace_stats* s = &stats[all[i].thread];
+        uint64_t tsc = all[i].tsc;
+        switch(all[i].type) {
+        case TRACE_READY:
+            s->ready_since = tsc;
+            break;
+        case TRACE_RUN:
+            if(s->ready_since != 0) {
+                s->wait_tsc += tsc - s->ready_since;
+            }
+            s->ready_since = 0;
+            s->running_since = tsc;
+            s->switches++;
+            break;
+        default:
+            if(s->running_since != 0) {
+                s->run_tsc += tsc - s->running_since;
+            }
+            s->running_since = 0;
+            s->ready_since = all[i].type == TRACE_STOP ? tsc : 0;
+            break;
+        }
+    }
+    free(all);
+    return stats;
+}
+
+static void trace_print_summary(FILE* out, struct trace_ring* rings, int num_rings,
+                                struct trace_calibration* c) {
+    int num_threads;
+    struct trace_stats* stats = trace_collect_stats(rings, num_rings, &num_threads);
+    fprintf(out, "%10s %10s %14s %14s\n", "thread", "switches", "cpu us", "run queue us");
+    for(int t = 0; t < num_threads; t++) {
+        if(stats[t].switches > 0) {
+            fprintf(out, "%10d %10lu %14.1f %14.1f\n", t, (unsigned long) stats[t].switches,
+                    stats[t].run_tsc / c->tsc_per_us, stats[t].wait_tsc / c->tsc_per_us);
+        }
+    }
+    free(stats);
+
+    // a scheduler's time between its first and last event that wasn't
+    // spent running a thread went to switching and picking threads
+    fprintf(out, "\n%10s %10s %14s %14s\n", "scheduler", "switches", "threads us", "scheduler us");
+    for(int r = 0; r < num_rings; r++) {
+        uint64_t first = trace_first_kept(&rings[r]);
+        uint64_t switches = 0, running = 0, since = 0;
+        for(uint64_t i = first; i < rings[r].count; i++) {
+            struct trace_event* e = &rings[r].events[i & (TRACE_RING_EVENTS - 1)];
+            if(e->type == TRACE_RUN) {
+                switches++;
+                since = e->tsc;
+            } else if(e->type != TRACE_READY && since != 0) {
+                running += e->tsc - since;
+                since = 0;
+            }
+        }
+        if(switches == 0) {
+            continue;
+        }
+        uint64_t span = rings[r].events[(rings[r].count - 1) & (TRACE_RING_EVENTS - 1)].tsc -
+            rings[r].events[first & (TRACE_RING_EVENTS - 1)].tsc;
+        fprintf(out, "%10d %10lu %14.1f %14.1f\n", r, (unsigned long) switches,
+                running / c->tsc_per_us, (span - running) / c->tsc_per_us);
+    }
+}
+
+/*
+trace_write_chrome_json
+
+Writes the rings in the Chrome trace event format to path: one
+complete ("X") event per stretch a thread ran, on the row of the
+scheduler pthread that ran it.  Returns false if the file can't be
+written.
+ */
+static bool trace_write_chrome_json(const char* path, struct trace_ring* rings, int num_rings,
+                                    struct trace_calibration* c) {
+    static const char* ends[] = { "ready", "run", "yield", "block", "exit" };
+    FILE* out = fopen(path, "w");
+    if(out == NULL) {
+        perror(path);
+        return false;
+    }
+    fprintf(out, "{\"traceEvents\":[\n");
+    bool first_event = true;
+    for(int r = 0; r < num_rings; r++) {
+        bool named = false;
+        struct trace_event* running = NULL;
+        for(uint64_t i = trace_first_kept(&rings[r]); i < rings[r].count; i++) {
+            struct trace_event* e = &rings[r].events[i & (TRACE_RING_EVENTS - 1)];
+            if(e->type == TRACE_RUN) {
+                running = e;
+            } else if(e->type != TRACE_READY && running != NULL) {
+                // rings that never ran a thread (only made some ready)
+                // don't get a row
+                if(!named) {
+                    fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                            "\"args\":{\"name\":\"scheduler %d\"}}", first_event ? "" : ",\n", r, r);
+                    first_event = false;
+                    named = true;
+                }
+                fprintf(out, ",\n{\"name\":\"thread %u\",\"cat\":\"run\",\"ph\":\"X\",\"pid\":1,"
+                        "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"end\":\"%s\"}}",
+                        running->thread, r, (running->tsc - c->tsc) / c->tsc_per_us,
+                        (e->tsc - running->tsc) / c->tsc_per_us, ends[e->type]);
+                running = NULL;
+            }
+        }
+    }
+    fprintf(out, "\n]}\n");
+    return fclose(out) == 0;
+}
+
+#endif
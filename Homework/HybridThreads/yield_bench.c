@@ -0,0 +1,131 @@
+/*
+yield_bench - measures how many yields per second the hybrid scheduler
+sustains as the number of scheduler pthreads grows.
+
+The workload is the one from create_para_tests.c: a few parent threads
+each create 25 children.  Here the children yield in a loop rather than
+taking a semaphore, so the scheduler is the only shared thing being
+measured.
+
+Build every version and compare:
+
+    make bench
+    ./yield_bench
+    ./yield_bench_single
+    ./yield_bench_fast
+
+yield_bench_single is built with SINGLE_ARRAY_SCHEDULER, i.e. every
+scheduler scans the one shared thread_state array under a semaphore.
+
+yield_bench_fast is built with FAST_CONTEXT_SWITCH, so it shows the
+cost of swapcontext versus fast_context.S.  ns/yield is wall clock
+time divided by the total number of yields.
+
+    ./yield_bench trace
+
+runs every case with uthread_trace_start on, to show what tracing
+costs, and writes the last case's trace to yield_bench_trace.json.
+
+    ./yield_bench record
+
+records every case to yield_bench.replay with uthread_record, to show
+what recording costs, then replays each and times the replay too.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include "hybrid_threads.h"
+
+#define NUM_PARENTS 3
+#define CHILDREN_PER_PARENT 25
+#define YIELDS_PER_CHILD 2000
+
+atomic_long total_yields;
+
+void yield_a_lot()
+{
+    for(int i = 0; i < YIELDS_PER_CHILD; i++) {
+        yield();
+    }
+    atomic_fetch_add(&total_yields, YIELDS_PER_CHILD);
+}
+
+void make_25_yielding_threads()
+{
+    for(int i = 0; i < CHILDREN_PER_PARENT; i++) {
+        create_new_thread(yield_a_lot);
+    }
+}
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void check_yields()
+{
+    long yields = atomic_load(&total_yields);
+    if(yields != (long) NUM_PARENTS * CHILDREN_PER_PARENT * YIELDS_PER_CHILD) {
+        printf("expected %d yields but counted %ld\n",
+               NUM_PARENTS * CHILDREN_PER_PARENT * YIELDS_PER_CHILD, yields);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    int scheduler_counts[] = {1, 2, 4, 8, 16, 32};
+    int num_counts = sizeof scheduler_counts / sizeof *scheduler_counts;
+    bool traced = argc > 1 && strcmp(argv[1], "trace") == 0;
+    bool recorded = argc > 1 && strcmp(argv[1], "record") == 0;
+
+    printf("%10s %12s %14s %10s%s\n", "pthreads", "seconds", "yields/sec", "ns/yield",
+           recorded ? "   replay seconds" : "");
+    for(int i = 0; i < num_counts; i++) {
+        atomic_store(&total_yields, 0);
+        initialize_basic_threads();
+        if(recorded) {
+            uthread_record("yield_bench.replay");
+        }
+        for(int j = 0; j < NUM_PARENTS; j++) {
+            create_new_thread(make_25_yielding_threads);
+        }
+
+        if(traced) {
+            uthread_trace_start();
+        }
+        double start = now_seconds();
+        schedule_hybrid_threads(scheduler_counts[i]);
+        double elapsed = now_seconds() - start;
+        if(traced) {
+            uthread_trace_stop();
+        }
+
+        check_yields();
+        long yields = atomic_load(&total_yields);
+        printf("%10d %12.3f %14.0f %10.1f", scheduler_counts[i], elapsed, yields / elapsed, elapsed * 1e9 / yields);
+
+        if(recorded) {
+            // the replay runs on this pthread alone, whatever was recorded
+            atomic_store(&total_yields, 0);
+            initialize_basic_threads();
+            uthread_replay("yield_bench.replay");
+            for(int j = 0; j < NUM_PARENTS; j++) {
+                create_new_thread(make_25_yielding_threads);
+            }
+            start = now_seconds();
+            schedule_hybrid_threads(scheduler_counts[i]);
+            elapsed = now_seconds() - start;
+            check_yields();
+            printf(" %16.3f", elapsed);
+        }
+        printf("\n");
+    }
+    if(traced && !uthread_trace_write_json("yield_bench_trace.json")) {
+        exit(1);
+    }
+}
@@ -12,31 +12,599 @@ these functions here in the .c file rather than the header.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "basic_threads.h"
+#include "timer_wheel.h"
+#include "uthread_trace.h"
 
-// 64kB stack
-#define THREAD_STACK_SIZE 1024*64
+/*
+Each thread stack reserves 1MB of address space, but the pages are
+only committed as the thread touches them, so a thread that never
+goes deep costs a page or two of real memory.  Below each stack is a
+guard page, so an overflow segfaults instead of silently scribbling
+on the neighbouring stack.
+
+Guard pages are installed with madvise(MADV_GUARD_INSTALL) (Linux
+6.13 and later), which doesn't split the slab's mapping.  On older
+kernels they are mprotected PROT_NONE instead, which does, so each
+live stack costs 2 of the kernel's vm.max_map_count mappings (65530
+by default).  Those guards stop once they would use half the
+mappings, leaving the rest for malloc and the like, and the rest of
+the stacks go without guards rather than thread creation failing.
+Freeing the slabs gives their guards back.
+*/
+#define THREAD_STACK_SIZE 1024*1024
+#define GUARD_SIZE 4096
+
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+// how many thread control blocks / stacks / coroutines each slab holds
+#define THREADS_PER_SLAB 64
+#define STACKS_PER_SLAB 16
+#define COROUTINES_PER_SLAB 4096
+#define FUTURES_PER_SLAB 1024
+
+// starting size of the thread table - it doubles whenever it fills
+#define INITIAL_TABLE_SIZE 16
+
+/*
+Scheduling classes.  Every thread in the deadline class runs before
+every thread in the priority class, and every priority thread runs
+before the round robin threads.  Round robin is what create_new_thread
+gives you, and if nothing else is ever created, scheduling works
+exactly as it always has.
+*/
+#define ROUND_ROBIN_CLASS 0
+#define PRIORITY_CLASS 1
+#define DEADLINE_CLASS 2
+
+// priorities are 0 to NUM_PRIORITIES-1, higher runs first
+#define NUM_PRIORITIES 32
+
+// resolution of uthread_sleep_us and timed waits
+#define TICK_US 100
+
+/*
+Context switching goes through thread_context / switch_context so the
+mechanism can be picked at build time.  By default it's ucontext.
+Building with -DFAST_CONTEXT_SWITCH (x86-64 only) uses fast_context.S
+instead, which skips swapcontext's signal mask system call.  The
+preemptive version of this library relies on each context keeping its
+own signal mask, so it must stay on ucontext.
+*/
+#ifdef FAST_CONTEXT_SWITCH
+#ifndef __x86_64__
+#error "FAST_CONTEXT_SWITCH is only implemented for x86-64"
+#endif
+#include "fast_context.h"
+typedef void* thread_context;
+#else
+typedef ucontext_t thread_context;
+#endif
+
+struct thread {
+    thread_context context;
+    void* stack;
+    void (*fun_ptr)(void*);
+    // set instead of fun_ptr by uthread_async
+    void* (*async_fun_ptr)(void*);
+    void* parameter;
+    bool finished;
+    // what the thread returned or passed to uthread_exit
+    void* result;
+    uthread_future* future;
+
+    int index;
+    int sched_class;
+    int priority;
+    long long deadline;
+    // creation order, to break ties between equal deadlines
+    unsigned long sequence;
+    // next thread in the same ready list (round robin or a priority
+    // level's)
+    struct thread* next_ready;
+
+    // sleeping or waiting on a semaphore, so not to be scheduled
+    bool blocked;
+    // fires when a sleep or a timed wait is up
+    struct timer timer;
+    // the semaphore we're waiting on, and our neighbours in its queue
+    uthread_sem* waiting_on;
+    struct thread* next_waiter;
+    struct thread* prev_waiter;
+    bool timed_out;
+};
+
+/*
+A stackless coroutine is just its step function, where to resume it
+and a link in the coroutine run queue - no stack and no saved
+registers.  It runs on the scheduler's stack.
+*/
+struct coroutine {
+    bool (*step)(int* resume, void* parameter);
+    void* parameter;
+    struct coroutine* next;
+    int resume;
+};
 
 /*
-max number of threads
+A thread's result.  It outlives the thread, until whoever holds the
+handle joins (or awaits) it, or detaches it.
+*/
+struct uthread_future {
+    void* value;
+    bool done;
+    bool detached;
+    // the thread blocked in uthread_join, if any
+    struct thread* waiter;
+};
+
+/*
+pool
+
+A fixed size object allocator.  Objects are carved out of big slabs,
+and freed objects go on a free list to be handed out again, so
+creating and finishing threads doesn't allocate a control block and a
+stack every time.
 
-note if we had an expandable structure like an arraylist in C it
-would be pretty easy to make this arbitrary, but let's not
-introduce extra C libraries.
+A pool with a guard_size mmaps its slabs and puts a PROT_NONE guard
+in front of every object - that's how the stacks are allocated.  The
+free list is linked through the last bytes of each object, since the
+top of a stack is the part a thread touches first anyway; linking
+through the bottom would commit a page per free stack.
+
+The slabs themselves are only freed by pool_release, which
+schedule_threads calls once every thread is done.
+*/
+struct slab {
+    struct slab* next;
+    char* memory;
+    size_t size;
+    // guards mprotected in this slab (see install_guard)
+    int mprotected_guards;
+};
+
+struct pool {
+    size_t object_size;
+    size_t guard_size;
+    int objects_per_slab;
+    struct slab* slabs;
+    void* free_list;
+};
+
+struct pool thread_pool = { sizeof(struct thread), 0, THREADS_PER_SLAB, NULL, NULL };
+struct pool stack_pool = { THREAD_STACK_SIZE, GUARD_SIZE, STACKS_PER_SLAB, NULL, NULL };
+struct pool coroutine_pool = { sizeof(struct coroutine), 0, COROUTINES_PER_SLAB, NULL, NULL };
+struct pool future_pool = { sizeof(struct uthread_future), 0, FUTURES_PER_SLAB, NULL, NULL };
+
+// storage for your thread data.  A NULL entry is an unused slot.  The
+// table holds pointers so growing it never moves a saved context.
+struct thread** threads;
+int table_size;
+
+// a stack of the unused slots' indexes, so finding one is O(1)
+int* free_slots;
+int free_count;
+
+int current_thread_index;
+thread_context parent;
+
+/*
+Ready round robin threads sit in a FIFO list, so picking the next one
+costs the same however many threads are blocked or asleep.
+*/
+struct thread* round_robin_head;
+struct thread* round_robin_tail;
+int round_robin_count;
 
-also note that the max we've picked is insanely small.  These threads
-are very lightweight so we could probably have thousands.  But that
-would make writing test code that exploits the thread max more
-annoying.  So please leave this value as it is and use MAX_THREADS
-(not the hardcorded value 5) in your code.
+/*
+Ready threads in the priority class sit in a FIFO list per priority
+level.  Bit n of priority_bitmap is set when level n's list is
+non-empty, so finding the highest ready level is one count leading
+zeros instruction however many threads there are.
 */
-#define MAX_THREADS 5
+struct thread* priority_head[NUM_PRIORITIES];
+struct thread* priority_tail[NUM_PRIORITIES];
+unsigned int priority_bitmap;
+
+// ready deadline class threads, a binary min heap on deadline
+struct thread** deadline_heap;
+int deadline_count;
+int deadline_capacity;
+
+unsigned long next_sequence;
+
+// threads that are not finished (including blocked ones)
+int live_threads;
+
+// scheduling events, when uthread_trace_start has turned tracing on
+bool tracing;
+struct trace_ring trace_ring;
+struct trace_calibration trace_calibration;
+
+// unfinished coroutines, in the order they take their turns
+struct coroutine* coroutine_head;
+struct coroutine* coroutine_tail;
+
+// the timers of sleeping threads and timed waits, ticks counted from
+// clock_start_us
+struct timer_wheel sleepers;
+long long clock_start_us;
 
-// storage for your thread data
-ucontext_t threads[MAX_THREADS];
+static void trace(struct thread* t, int type) {
+    if(tracing) {
+        trace_record(&trace_ring, t->sequence, type);
+    }
+}
+
+static void switch_context(thread_context* save, thread_context* resume) {
+#ifdef FAST_CONTEXT_SWITCH
+    fast_switch(save, *resume);
+#else
+    swapcontext(save, resume);
+#endif
+}
+
+static void** free_link(struct pool* p, void* object) {
+    return (void**) ((char*) object + p->object_size - sizeof(void*));
+}
+
+static void pool_free(struct pool* p, void* object) {
+    *free_link(p, object) = p->free_list;
+    p->free_list = object;
+}
+
+static bool madvise_guards = true;
+static bool guards_available = true;
+// mprotected guards in slabs not yet freed, and how many we allow, or
+// -1 if not known yet
+static long mprotected_guards;
+static long max_mprotected_guards = -1;
+
+// a quarter of vm.max_map_count, as each mprotected guard splits a
+// mapping in two
+static long find_max_mprotected_guards() {
+    long max_map_count = 65530;
+    FILE* f = fopen("/proc/sys/vm/max_map_count", "r");
+    if(f != NULL) {
+        if(fscanf(f, "%ld", &max_map_count) != 1) {
+            max_map_count = 65530;
+        }
+        fclose(f);
+    }
+    return max_map_count / 4;
+}
+
+// makes the guard_size bytes at guard fault on any access, if we can,
+// and returns true if that took an mprotect
+static bool install_guard(char* guard, size_t size) {
+    if(madvise_guards && madvise(guard, size, MADV_GUARD_INSTALL) == 0) {
+        return false;
+    }
+    // EINVAL means the kernel doesn't know MADV_GUARD_INSTALL
+    madvise_guards = false;
+    if(max_mprotected_guards < 0) {
+        max_mprotected_guards = find_max_mprotected_guards();
+    }
+    if(!guards_available) {
+        return false;
+    }
+    if(mprotected_guards >= max_mprotected_guards ||
+       mprotect(guard, size, PROT_NONE) < 0) {
+        if(mprotected_guards < max_mprotected_guards && errno != ENOMEM) {
+            perror("could not mprotect a guard page");
+            exit(1);
+        }
+        fprintf(stderr, "out of memory mappings for guard pages, so new stacks are unguarded\n");
+        guards_available = false;
+        return false;
+    }
+    mprotected_guards++;
+    return true;
+}
 
+static void add_slab(struct pool* p) {
+    struct slab* slab = malloc(sizeof(struct slab));
+    if(slab == NULL) {
+        printf("could not malloc a slab\n");
+        exit(1);
+    }
+    size_t stride = p->guard_size + p->object_size;
+    slab->size = stride * p->objects_per_slab;
+    if(p->guard_size == 0) {
+        slab->memory = malloc(slab->size);
+        if(slab->memory == NULL) {
+            printf("could not malloc a slab\n");
+            exit(1);
+        }
+    } else {
+        // MAP_NORESERVE: we only want address space here, pages get
+        // committed as they are touched
+        slab->memory = mmap(NULL, slab->size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                            -1, 0);
+        if(slab->memory == MAP_FAILED) {
+            perror("could not mmap a slab");
+            exit(1);
+        }
+    }
+    slab->next = p->slabs;
+    slab->mprotected_guards = 0;
+    p->slabs = slab;
+
+    for(int i = p->objects_per_slab - 1; i >= 0; i--) {
+        char* guard = slab->memory + i * stride;
+        if(p->guard_size > 0 && install_guard(guard, p->guard_size)) {
+            slab->mprotected_guards++;
+        }
+        pool_free(p, guard + p->guard_size);
+    }
+}
 
-// add additional constants and globals here as you need
+static void* pool_alloc(struct pool* p) {
+    if(p->free_list == NULL) {
+        add_slab(p);
+    }
+    void* object = p->free_list;
+    p->free_list = *free_link(p, object);
+    return object;
+}
+
+static void pool_release(struct pool* p) {
+    while(p->slabs != NULL) {
+        struct slab* next = p->slabs->next;
+        if(p->guard_size == 0) {
+            free(p->slabs->memory);
+        } else {
+            munmap(p->slabs->memory, p->slabs->size);
+            mprotected_guards -= p->slabs->mprotected_guards;
+        }
+        free(p->slabs);
+        p->slabs = next;
+    }
+    p->free_list = NULL;
+    if(mprotected_guards < max_mprotected_guards) {
+        guards_available = true;
+    }
+}
+
+/*
+get_committed_stack_bytes
+
+Returns how many bytes of thread stack are actually backed by memory
+right now (as opposed to just reserved), according to mincore.
+ */
+size_t get_committed_stack_bytes() {
+    size_t page = getpagesize();
+    size_t committed = 0;
+    for(struct slab* slab = stack_pool.slabs; slab != NULL; slab = slab->next) {
+        size_t pages = slab->size / page;
+        unsigned char* resident = malloc(pages);
+        if(resident == NULL || mincore(slab->memory, slab->size, resident) < 0) {
+            perror("mincore");
+            exit(1);
+        }
+        for(size_t i = 0; i < pages; i++) {
+            committed += (resident[i] & 1) * page;
+        }
+        free(resident);
+    }
+    return committed;
+}
+
+static int find_free_slot() {
+    if(free_count > 0) {
+        return free_slots[--free_count];
+    }
+    int new_size = table_size == 0 ? INITIAL_TABLE_SIZE : table_size * 2;
+    struct thread** bigger = realloc(threads, new_size * sizeof *threads);
+    int* bigger_free = realloc(free_slots, new_size * sizeof *free_slots);
+    if(bigger == NULL || bigger_free == NULL) {
+        printf("could not grow the thread table\n");
+        exit(1);
+    }
+    threads = bigger;
+    free_slots = bigger_free;
+    // pushed highest first so the new slots are handed out in order
+    for(int i = new_size - 1; i >= table_size; i--) {
+        threads[i] = NULL;
+        free_slots[free_count++] = i;
+    }
+    table_size = new_size;
+    return free_slots[--free_count];
+}
+
+static void round_robin_push(struct thread* t) {
+    t->next_ready = NULL;
+    if(round_robin_head == NULL) {
+        round_robin_head = t;
+    } else {
+        round_robin_tail->next_ready = t;
+    }
+    round_robin_tail = t;
+    round_robin_count++;
+}
+
+// returns NULL if no round robin thread is ready
+static struct thread* round_robin_pop() {
+    struct thread* t = round_robin_head;
+    if(t != NULL) {
+        round_robin_head = t->next_ready;
+        round_robin_count--;
+    }
+    return t;
+}
+
+static void priority_push(struct thread* t) {
+    t->next_ready = NULL;
+    if(priority_head[t->priority] == NULL) {
+        priority_head[t->priority] = t;
+        priority_bitmap |= 1u << t->priority;
+    } else {
+        priority_tail[t->priority]->next_ready = t;
+    }
+    priority_tail[t->priority] = t;
+}
+
+// returns NULL if no priority class thread is ready
+static struct thread* priority_pop() {
+    if(priority_bitmap == 0) {
+        return NULL;
+    }
+    int level = 31 - __builtin_clz(priority_bitmap);
+    struct thread* t = priority_head[level];
+    priority_head[level] = t->next_ready;
+    if(priority_head[level] == NULL) {
+        priority_bitmap &= ~(1u << level);
+    }
+    return t;
+}
+
+static bool runs_before(struct thread* a, struct thread* b) {
+    if(a->deadline != b->deadline) {
+        return a->deadline < b->deadline;
+    }
+    return a->sequence < b->sequence;
+}
+
+static void deadline_push(struct thread* t) {
+    if(deadline_count == deadline_capacity) {
+        int new_capacity = deadline_capacity == 0 ? INITIAL_TABLE_SIZE : deadline_capacity * 2;
+        struct thread** bigger = realloc(deadline_heap, new_capacity * sizeof *deadline_heap);
+        if(bigger == NULL) {
+            printf("could not grow the deadline heap\n");
+            exit(1);
+        }
+        deadline_heap = bigger;
+        deadline_capacity = new_capacity;
+    }
+    int i = deadline_count++;
+    while(i > 0 && runs_before(t, deadline_heap[(i - 1) / 2])) {
+        deadline_heap[i] = deadline_heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    deadline_heap[i] = t;
+}
+
+// returns NULL if no deadline class thread is ready
+static struct thread* deadline_pop() {
+    if(deadline_count == 0) {
+        return NULL;
+    }
+    struct thread* earliest = deadline_heap[0];
+    struct thread* last = deadline_heap[--deadline_count];
+    int i = 0;
+    while(1) {
+        int child = 2 * i + 1;
+        if(child >= deadline_count) {
+            break;
+        }
+        if(child + 1 < deadline_count && runs_before(deadline_heap[child + 1], deadline_heap[child])) {
+            child++;
+        }
+        if(!runs_before(deadline_heap[child], last)) {
+            break;
+        }
+        deadline_heap[i] = deadline_heap[child];
+        i = child;
+    }
+    deadline_heap[i] = last;
+    return earliest;
+}
+
+static void make_ready(struct thread* t) {
+    if(t->sched_class == DEADLINE_CLASS) {
+        deadline_push(t);
+    } else if(t->sched_class == PRIORITY_CLASS) {
+        priority_push(t);
+    } else {
+        round_robin_push(t);
+    }
+}
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static unsigned long long current_tick() {
+    return (now_us() - clock_start_us) / TICK_US;
+}
+
+static void waiter_remove(uthread_sem* sem, struct thread* t) {
+    if(t->prev_waiter != NULL) {
+        t->prev_waiter->next_waiter = t->next_waiter;
+    } else {
+        sem->first = t->next_waiter;
+    }
+    if(t->next_waiter != NULL) {
+        t->next_waiter->prev_waiter = t->prev_waiter;
+    } else {
+        sem->last = t->prev_waiter;
+    }
+    t->waiting_on = NULL;
+}
+
+static void unblock(struct thread* t) {
+    t->blocked = false;
+    trace(t, TRACE_READY);
+    make_ready(t);
+}
+
+static void timer_expired(struct timer* timer) {
+    struct thread* t = (struct thread*) ((char*) timer - offsetof(struct thread, timer));
+    if(t->waiting_on != NULL) {
+        waiter_remove(t->waiting_on, t);
+        t->timed_out = true;
+    }
+    unblock(t);
+}
+
+// called whenever the scheduler is about to pick a thread
+static void wake_expired_sleepers() {
+    if(sleepers.count > 0) {
+        timer_wheel_advance(&sleepers, current_tick(), timer_expired);
+    }
+}
+
+// nothing is runnable, so sleep the whole process until the next
+// timer could be due
+static void wait_for_sleepers() {
+    if(sleepers.count == 0) {
+        printf("deadlock: every thread is waiting on a semaphore\n");
+        exit(1);
+    }
+    long long wake_at = clock_start_us + timer_wheel_next_tick(&sleepers) * TICK_US;
+    long long delay = wake_at - now_us();
+    if(delay > 0) {
+        usleep(delay);
+    }
+}
+
+static void release_thread(int index) {
+    uthread_future* future = threads[index]->future;
+    if(future->detached) {
+        pool_free(&future_pool, future);
+    } else {
+        future->value = threads[index]->result;
+        future->done = true;
+        if(future->waiter != NULL) {
+            unblock(future->waiter);
+        }
+    }
+    pool_free(&stack_pool, threads[index]->stack);
+    pool_free(&thread_pool, threads[index]);
+    threads[index] = NULL;
+    live_threads--;
+    free_slots[free_count++] = index;
+}
 
 
 /*
@@ -59,7 +627,31 @@ blank.
 
  */
 void initialize_basic_threads() {
-
+    free(threads);
+    threads = NULL;
+    table_size = 0;
+    free(free_slots);
+    free_slots = NULL;
+    free_count = 0;
+    round_robin_head = NULL;
+    round_robin_tail = NULL;
+    round_robin_count = 0;
+
+    for(int i = 0; i < NUM_PRIORITIES; i++) {
+        priority_head[i] = NULL;
+    }
+    priority_bitmap = 0;
+    free(deadline_heap);
+    deadline_heap = NULL;
+    deadline_count = 0;
+    deadline_capacity = 0;
+    next_sequence = 0;
+
+    live_threads = 0;
+    coroutine_head = NULL;
+    coroutine_tail = NULL;
+    clock_start_us = now_us();
+    timer_wheel_init(&sleepers, 0);
 }
 
 /*
@@ -69,17 +661,20 @@ Gets a new thread ready to run, but does not start it.  It will be
 started within schedule_threads() when it is this thread's turn (see
 below).
 
+Returns a handle for uthread_join.  A thread nobody joins or detaches
+keeps a few bytes for its result until schedule_threads returns.
+
 This function takes a function pointer to the function the thread
 should run when it starts.  The function provided should take no
 parameters and return nothing (at least in our first iteration).
 
-To create a new thread, memory must be allocated to store the thread's
-stack.  This function should malloc that memory.
+There is no limit on the number of threads - the thread table grows
+as needed.  The thread's control block and stack come from pools, so
+a thread created after another finished reuses the finished thread's
+stack rather than mallocing a new one.
 
-The function could fail either because the number of threads is at max
-or enough memory cannot be malloc'ed.  Either way, it's fine if this
-function prints and exits the program (use "exit(errorCode);" to exit
-with an error code - note that 0 means no error).
+The function could fail if enough memory cannot be malloc'ed.  It
+prints and exits the program if so.
 
 Example usage:
 
@@ -93,8 +688,8 @@ void thread_function()
 create_new_thread(thread_function());
 
  */
-void create_new_thread(void (*fun_ptr)()) {
-
+uthread_t create_new_thread(void (*fun_ptr)()) {
+    return create_new_parameterized_thread((void (*)(void*)) fun_ptr, NULL);
 }
 
 
@@ -124,8 +719,186 @@ schedule_threads();
 
  */
 
-void create_new_parameterized_thread(void (*fun_ptr)(void*), void* parameter) {
+static void thread_run_helper(int index) {
+    struct thread* t = threads[index];
+    if(t->async_fun_ptr != NULL) {
+        uthread_exit(t->async_fun_ptr(t->parameter));
+    }
+    t->fun_ptr(t->parameter);
+    finish_thread();
+}
 
+static struct thread* create_thread_in_class(void (*fun_ptr)(void*), void* parameter, int sched_class) {
+    int index = find_free_slot();
+    struct thread* t = pool_alloc(&thread_pool);
+
+    t->fun_ptr = fun_ptr;
+    t->async_fun_ptr = NULL;
+    t->parameter = parameter;
+    t->finished = false;
+    t->result = NULL;
+    t->future = pool_alloc(&future_pool);
+    t->future->done = false;
+    t->future->detached = false;
+    t->future->waiter = NULL;
+    t->index = index;
+    t->sched_class = sched_class;
+    t->priority = 0;
+    t->deadline = 0;
+    t->sequence = next_sequence++;
+    t->blocked = false;
+    t->timer.pprev = NULL;
+    t->waiting_on = NULL;
+    t->stack = pool_alloc(&stack_pool);
+#ifdef FAST_CONTEXT_SWITCH
+    t->context = fast_context_make(t->stack, THREAD_STACK_SIZE, thread_run_helper, index);
+#else
+    getcontext(&t->context);
+    t->context.uc_stack.ss_sp = t->stack;
+    t->context.uc_stack.ss_size = THREAD_STACK_SIZE;
+    t->context.uc_link = NULL;
+    makecontext(&t->context, (void (*)()) thread_run_helper, 1, index);
+#endif
+
+    threads[index] = t;
+    live_threads++;
+    trace(t, TRACE_READY);
+    return t;
+}
+
+uthread_t create_new_parameterized_thread(void (*fun_ptr)(void*), void* parameter) {
+    struct thread* t = create_thread_in_class(fun_ptr, parameter, ROUND_ROBIN_CLASS);
+    make_ready(t);
+    return t->future;
+}
+
+/*
+create_new_priority_thread
+
+Like create_new_parameterized_thread, but the thread is in the
+priority class.  priority is from 0 to 31, and higher priorities run
+first.  Any ready priority thread runs ahead of every round robin
+thread, starting at the next yield.  Threads of equal priority take
+turns round robin.  A priority thread that never stops yielding
+starves everything below it, so use these for short latency sensitive
+work.
+
+Example usage:
+
+create_new_thread(batch_work);
+create_new_priority_thread(handle_request, &request, 10);
+schedule_threads(); // handle_request runs before batch_work
+*/
+uthread_t create_new_priority_thread(void (*fun_ptr)(void*), void* parameter, int priority) {
+    if(priority < 0 || priority >= NUM_PRIORITIES) {
+        printf("priority %d is out of range (0 to %d)\n", priority, NUM_PRIORITIES - 1);
+        exit(1);
+    }
+    struct thread* t = create_thread_in_class(fun_ptr, parameter, PRIORITY_CLASS);
+    t->priority = priority;
+    make_ready(t);
+    return t->future;
+}
+
+/*
+create_new_deadline_thread
+
+Like create_new_parameterized_thread, but the thread is in the
+deadline class and should be done within deadline_us microseconds of
+being created.  Deadline threads run earliest deadline first, ahead of
+every priority and round robin thread.  Since nothing here is
+preemptive, a deadline thread keeps running through its yields until
+it finishes or an earlier deadline thread is created.
+*/
+uthread_t create_new_deadline_thread(void (*fun_ptr)(void*), void* parameter, long deadline_us) {
+    struct thread* t = create_thread_in_class(fun_ptr, parameter, DEADLINE_CLASS);
+    t->deadline = now_us() + deadline_us;
+    make_ready(t);
+    return t->future;
+}
+
+
+/*
+create_new_coroutine
+
+Creates a stackless coroutine: a task with no stack of its own, for
+when there are far too many small tasks to give each a thread.  A
+coroutine costs 32 bytes plus whatever state it keeps in parameter,
+so a million of them fit easily where a million threads would not.
+
+The scheduler runs coroutines along with the round robin threads.
+Each pass over the round robin threads is followed by one pass over
+the coroutines, calling each coroutine's step function once.  step
+runs until its next COROUTINE_YIELD and returns false, or runs off
+COROUTINE_END and returns true, which finishes the coroutine.  resume
+is where the macros keep track of how far step got (0 the first
+time).
+
+step runs on the scheduler's stack, so it must not call yield,
+finish_thread, uthread_sleep_us or uthread_sem_wait - those switch
+away from a thread's stack.  Use COROUTINE_WAIT_UNTIL to wait instead.
+Creating threads and coroutines, and uthread_sem_post, are fine.
+
+Example usage:
+
+struct countdown { int n; };
+
+bool count_down(int* resume, void* parameter) {
+    struct countdown* c = parameter;
+    COROUTINE_BEGIN(resume);
+    while(c->n > 0) {
+        c->n--;
+        COROUTINE_YIELD(resume);
+    }
+    COROUTINE_END(resume);
+}
+
+// elsewhere
+
+create_new_coroutine(count_down, &countdown);
+*/
+void create_new_coroutine(bool (*step)(int* resume, void* parameter), void* parameter) {
+    struct coroutine* co = pool_alloc(&coroutine_pool);
+    co->step = step;
+    co->parameter = parameter;
+    co->resume = 0;
+    co->next = NULL;
+    if(coroutine_tail == NULL) {
+        coroutine_head = co;
+    } else {
+        coroutine_tail->next = co;
+    }
+    coroutine_tail = co;
+}
+
+// gives every coroutine that was waiting when we started one step;
+// returns true if there were any
+static bool run_coroutines() {
+    struct coroutine* last = coroutine_tail;
+    if(last == NULL) {
+        return false;
+    }
+    while(1) {
+        struct coroutine* co = coroutine_head;
+        coroutine_head = co->next;
+        if(coroutine_head == NULL) {
+            coroutine_tail = NULL;
+        }
+        if(co->step(&co->resume, co->parameter)) {
+            pool_free(&coroutine_pool, co);
+        } else {
+            co->next = NULL;
+            if(coroutine_tail == NULL) {
+                coroutine_head = co;
+            } else {
+                coroutine_tail->next = co;
+            }
+            coroutine_tail = co;
+        }
+        if(co == last) {
+            return true;
+        }
+    }
 }
 
 
@@ -150,6 +923,12 @@ run 1 2 3 1 2 3 1 2 3 etc. - giving each thread an equal turn.  We'll
 talk about why you might want more fancy scheduling systems later in
 the course.
 
+(Threads made with create_new_priority_thread or
+create_new_deadline_thread are the exception.  Before each round robin
+turn, the scheduler runs any of those that are ready.  Coroutines from
+create_new_coroutine get a step after each pass over the round robin
+threads.)
+
 Example usage:
 
 create_new_thread(thread_function1());
@@ -160,8 +939,65 @@ printf("Starting threads...");
 schedule_threads()
 printf("All threads finished");
 */
-void schedule_threads() {
+static void run_thread(int index) {
+    current_thread_index = index;
+    trace(threads[index], TRACE_RUN);
+    switch_context(&parent, &threads[index]->context);
+    if(threads[index]->finished) {
+        trace(threads[index], TRACE_EXIT);
+        release_thread(index);
+    } else if(threads[index]->blocked) {
+        trace(threads[index], TRACE_BLOCK);
+    } else {
+        trace(threads[index], TRACE_STOP);
+        make_ready(threads[index]);
+    }
+}
+
+// runs deadline then priority threads until none are ready; returns
+// true if it ran anything
+static bool run_urgent_threads() {
+    bool ran = false;
+    while(1) {
+        wake_expired_sleepers();
+        struct thread* t = deadline_pop();
+        if(t == NULL) {
+            t = priority_pop();
+        }
+        if(t == NULL) {
+            return ran;
+        }
+        run_thread(t->index);
+        ran = true;
+    }
+}
 
+void schedule_threads() {
+    while(live_threads > 0 || coroutine_head != NULL) {
+        bool ran = run_urgent_threads();
+        // one pass: every thread that was ready when it started gets a
+        // turn.  Threads that yield (or are created) during the pass go
+        // to the back of the list and wait for the next one.
+        for(int turns = round_robin_count; turns > 0; turns--) {
+            struct thread* t = round_robin_pop();
+            if(t == NULL) {
+                break;
+            }
+            ran = true;
+            run_thread(t->index);
+            run_urgent_threads();
+        }
+        if(run_coroutines()) {
+            ran = true;
+        }
+        if(!ran && live_threads > 0) {
+            wait_for_sleepers();
+        }
+    }
+    pool_release(&thread_pool);
+    pool_release(&stack_pool);
+    pool_release(&coroutine_pool);
+    pool_release(&future_pool);
 }
 
 /*
@@ -204,7 +1040,7 @@ void thread_function()
 
 */
 void yield() {
-
+    switch_context(&threads[current_thread_index]->context, &parent);
 }
 
 /*
@@ -217,9 +1053,9 @@ Eventually, we'll figure out a way to have this function called
 implicitly when the thread function returns but for simplicity in our
 earily examples we just call it directly.
 
-Note: This is not a good place to call the free corresponding to the
-malloc in create_new_thread.  For the first couple tests it's OK to
-let that memory leak and then we'll discuss the issue in detail.
+Note: the thread is still running on its own stack here, so this is
+not the place to give the stack back to the pool.  schedule_threads
+does that once it has switched off of it.
 
 Example usage:
 
@@ -232,5 +1068,246 @@ void thread_function()
 
 */
 void finish_thread() {
+    threads[current_thread_index]->finished = true;
+    switch_context(&threads[current_thread_index]->context, &parent);
+}
+
+static void block_current_thread() {
+    struct thread* t = threads[current_thread_index];
+    t->blocked = true;
+    switch_context(&t->context, &parent);
+}
+
+/*
+uthread_exit
+
+Like finish_thread, but result is what uthread_join hands back.
+Returning from the thread function is the same as uthread_exit(NULL).
+*/
+void uthread_exit(void* result) {
+    threads[current_thread_index]->result = result;
+    finish_thread();
+}
+
+/*
+uthread_join
+
+Waits (blocking only the calling thread) until thread has finished,
+then stores its result in *result unless result is NULL.  Each thread
+can be joined once, and after that the handle is gone.  Must be
+called from a thread, not from outside schedule_threads.
+
+Example usage:
+
+uthread_t worker = create_new_thread(do_work);
+// ...
+void* answer;
+uthread_join(worker, &answer);
+*/
+void uthread_join(uthread_t thread, void** result) {
+    void* value = uthread_await(thread);
+    if(result != NULL) {
+        *result = value;
+    }
+}
+
+/*
+uthread_detach
+
+Gives up the handle, so nobody will join the thread and its result is
+thrown away once it finishes.
+*/
+void uthread_detach(uthread_t thread) {
+    if(thread->done) {
+        pool_free(&future_pool, thread);
+    } else {
+        thread->detached = true;
+    }
+}
+
+/*
+uthread_async / uthread_await
+
+uthread_async runs fun_ptr(parameter) in a new round robin thread and
+returns a future for what it returns.  uthread_await blocks the
+calling thread until that value is ready and returns it.  Like
+uthread_join, each future is awaited once, from inside a thread.
+
+Fanning work out and back in is one uthread_async per piece followed
+by one uthread_await per piece:
+
+uthread_future* parts[CHUNKS];
+for(int i = 0; i < CHUNKS; i++) {
+    parts[i] = uthread_async(sum_chunk, &chunks[i]);
+}
+long total = 0;
+for(int i = 0; i < CHUNKS; i++) {
+    total += (long) uthread_await(parts[i]);
+}
+*/
+uthread_future* uthread_async(void* (*fun_ptr)(void*), void* parameter) {
+    struct thread* t = create_thread_in_class(NULL, parameter, ROUND_ROBIN_CLASS);
+    t->async_fun_ptr = fun_ptr;
+    make_ready(t);
+    return t->future;
+}
+
+void* uthread_await(uthread_future* future) {
+    if(!future->done) {
+        future->waiter = threads[current_thread_index];
+        block_current_thread();
+    }
+    void* value = future->value;
+    pool_free(&future_pool, future);
+    return value;
+}
+
+/*
+uthread_sleep_us
+
+Puts the current thread to sleep for at least usecs microseconds
+without holding up the other threads (unlike sleep or usleep, which
+would stop the scheduler too).  Sleeps are rounded up to the next
+100us tick, and a sleeping thread is woken the next time the scheduler
+picks a thread after it is due.
+
+Example usage:
+
+void thread_function()
+{
+    uthread_sleep_us(5000); // other threads run meanwhile
+}
+*/
+void uthread_sleep_us(long usecs) {
+    struct thread* t = threads[current_thread_index];
+    t->timer.expires = (now_us() + usecs - clock_start_us + TICK_US - 1) / TICK_US;
+    timer_wheel_add(&sleepers, &t->timer);
+    block_current_thread();
+}
 
+/*
+uthread_sem
+
+A counting semaphore for userspace threads.  Waiting blocks only the
+calling thread, and waiters are woken first come first served.
+uthread_sem_timedwait gives up after timeout_us microseconds and
+returns false if it timed out, true if it got the semaphore.
+*/
+void uthread_sem_init(uthread_sem* sem, int value) {
+    sem->value = value;
+    sem->first = NULL;
+    sem->last = NULL;
+}
+
+void uthread_sem_wait(uthread_sem* sem) {
+    uthread_sem_timedwait(sem, -1);
+}
+
+bool uthread_sem_timedwait(uthread_sem* sem, long timeout_us) {
+    if(sem->value > 0) {
+        sem->value--;
+        return true;
+    }
+    if(timeout_us == 0) {
+        return false;
+    }
+    struct thread* t = threads[current_thread_index];
+    t->waiting_on = sem;
+    t->timed_out = false;
+    t->next_waiter = NULL;
+    t->prev_waiter = sem->last;
+    if(sem->last != NULL) {
+        sem->last->next_waiter = t;
+    } else {
+        sem->first = t;
+    }
+    sem->last = t;
+    // a negative timeout means wait forever
+    if(timeout_us > 0) {
+        t->timer.expires = (now_us() + timeout_us - clock_start_us + TICK_US - 1) / TICK_US;
+        timer_wheel_add(&sleepers, &t->timer);
+    }
+    block_current_thread();
+    return !t->timed_out;
+}
+
+void uthread_sem_post(uthread_sem* sem) {
+    struct thread* t = sem->first;
+    if(t == NULL) {
+        sem->value++;
+        return;
+    }
+    // hand the count straight to the oldest waiter
+    waiter_remove(sem, t);
+    if(timer_pending(&t->timer)) {
+        timer_wheel_remove(&sleepers, &t->timer);
+    }
+    unblock(t);
+}
+
+/*
+uthread_trace_start
+
+Starts recording every time a thread is switched in or out, or
+becomes ready to run, throwing away anything recorded before.  The
+events go in a ring of the latest 65536 (see uthread_trace.h), stamped
+with the CPU's timestamp counter, which costs a few nanoseconds per
+switch.  Tracing stays on until uthread_trace_stop, across calls to
+schedule_threads.  Coroutine steps aren't traced.
+
+uthread_trace_stats fills in stats for one thread (numbered in
+creation order) and returns false if the trace has nothing on it:
+how many times it was switched in, how long it ran, and how long it
+waited runnable for its turn.  uthread_trace_summary prints that for
+every thread, plus how much time the scheduler itself took.
+uthread_trace_write_json writes a Chrome trace to path, to look at in
+chrome://tracing or ui.perfetto.dev.
+
+Example usage:
+
+uthread_trace_start();
+schedule_threads();
+uthread_trace_stop();
+uthread_trace_summary();
+uthread_trace_write_json("trace.json");
+*/
+void uthread_trace_start() {
+    trace_ring.count = 0;
+    trace_calibrate(&trace_calibration, true);
+    tracing = true;
+}
+
+void uthread_trace_stop() {
+    tracing = false;
+    trace_calibrate(&trace_calibration, false);
+}
+
+bool uthread_trace_stats(int thread, uthread_stats* stats) {
+    if(tracing) {
+        trace_calibrate(&trace_calibration, false);
+    }
+    int num_threads;
+    struct trace_stats* all = trace_collect_stats(&trace_ring, 1, &num_threads);
+    bool found = thread >= 0 && thread < num_threads && all[thread].switches > 0;
+    if(found) {
+        stats->switches = all[thread].switches;
+        stats->cpu_us = all[thread].run_tsc / trace_calibration.tsc_per_us;
+        stats->wait_us = all[thread].wait_tsc / trace_calibration.tsc_per_us;
+    }
+    free(all);
+    return found;
+}
+
+void uthread_trace_summary() {
+    if(tracing) {
+        trace_calibrate(&trace_calibration, false);
+    }
+    trace_print_summary(stdout, &trace_ring, 1, &trace_calibration);
+}
+
+bool uthread_trace_write_json(const char* path) {
+    if(tracing) {
+        trace_calibrate(&trace_calibration, false);
+    }
+    return trace_write_chrome_json(path, &trace_ring, 1, &trace_calibration);
 }
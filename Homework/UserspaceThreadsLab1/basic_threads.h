@@ -9,15 +9,98 @@ these functions in the .c file rather than the header.
 You should not need to modify this header.
 
  */
+#include <stddef.h>
+#include <stdbool.h>
+
+struct thread;
+
+/*
+A future is a value that a thread will produce.  Every thread has one
+(its result), and that doubles as the thread's handle.
+*/
+typedef struct uthread_future uthread_future;
+typedef uthread_future* uthread_t;
+
+typedef struct {
+    int value;
+    struct thread* first;
+    struct thread* last;
+} uthread_sem;
+
+/*
+Stackless coroutines (see create_new_coroutine in basic_threads.c).
+A coroutine's step function is written between COROUTINE_BEGIN and
+COROUTINE_END, and gives up its turn with COROUTINE_YIELD.  Local
+variables do not survive a yield, so keep state in the parameter.
+None of these can be used inside a switch statement of your own.
+*/
+#define COROUTINE_BEGIN(resume) switch(*(resume)) { case 0:
+
+#define COROUTINE_YIELD(resume) \
+    do { *(resume) = __LINE__; return false; case __LINE__:; } while(0)
+
+#define COROUTINE_WAIT_UNTIL(resume, condition) \
+    do { *(resume) = __LINE__; case __LINE__: if(!(condition)) return false; } while(0)
+
+#define COROUTINE_END(resume) } return true
 
 void initialize_basic_threads();
 
-void create_new_thread(void (*fun_ptr)());
+uthread_t create_new_thread(void (*fun_ptr)());
+
+uthread_t create_new_parameterized_thread(void (*fun_ptr)(void*), void* parameter);
+
+uthread_t create_new_priority_thread(void (*fun_ptr)(void*), void* parameter, int priority);
+
+uthread_t create_new_deadline_thread(void (*fun_ptr)(void*), void* parameter, long deadline_us);
 
-void create_new_parameterized_thread(void (*fun_ptr)(void*), void* parameter);
+void create_new_coroutine(bool (*step)(int* resume, void* parameter), void* parameter);
 
 void schedule_threads();
 
 void yield();
 
 void finish_thread();
+
+void uthread_exit(void* result);
+
+void uthread_join(uthread_t thread, void** result);
+
+void uthread_detach(uthread_t thread);
+
+uthread_future* uthread_async(void* (*fun_ptr)(void*), void* parameter);
+
+void* uthread_await(uthread_future* future);
+
+size_t get_committed_stack_bytes();
+
+void uthread_sleep_us(long usecs);
+
+void uthread_sem_init(uthread_sem* sem, int value);
+
+void uthread_sem_wait(uthread_sem* sem);
+
+bool uthread_sem_timedwait(uthread_sem* sem, long timeout_us);
+
+void uthread_sem_post(uthread_sem* sem);
+
+/*
+Tracing (see uthread_trace_start in basic_threads.c).  Threads are
+numbered in the order they were created, from 0 after each
+initialize_basic_threads.
+*/
+typedef struct {
+    long switches;
+    double cpu_us;
+    double wait_us;
+} uthread_stats;
+
+void uthread_trace_start();
+
+void uthread_trace_stop();
+
+bool uthread_trace_stats(int thread, uthread_stats* stats);
+
+void uthread_trace_summary();
+
+bool uthread_trace_write_json(const char* path);
@@ -172,6 +172,297 @@ void test_5(CuTest *tc) {
 }
 
 
+char run_order[64];
+
+void log_run(char name) {
+    int len = strlen(run_order);
+    run_order[len] = name;
+    run_order[len + 1] = '\0';
+}
+
+// logs its parameter (a char) twice with a yield between
+void log_twice(void* name)
+{
+    log_run(*(char*) name);
+    yield();
+    log_run(*(char*) name);
+}
+
+char a = 'a', b = 'b', c = 'c', d = 'd';
+
+void test_6priority_runs_before_round_robin(CuTest *tc) {
+    run_order[0] = '\0';
+    initialize_basic_threads();
+    create_new_parameterized_thread(log_twice, &a);
+    create_new_parameterized_thread(log_twice, &b);
+    create_new_priority_thread(log_twice, &c, 5);
+    schedule_threads();
+    CuAssertStrEquals(tc, "ccabab", run_order);
+}
+
+void test_6priority_levels(CuTest *tc) {
+    run_order[0] = '\0';
+    initialize_basic_threads();
+    create_new_priority_thread(log_twice, &a, 2);
+    create_new_priority_thread(log_twice, &b, 31);
+    create_new_priority_thread(log_twice, &c, 31);
+    create_new_priority_thread(log_twice, &d, 0);
+    schedule_threads();
+    // equal priorities round robin with each other
+    CuAssertStrEquals(tc, "bcbcaadd", run_order);
+}
+
+void test_6earliest_deadline_first(CuTest *tc) {
+    run_order[0] = '\0';
+    initialize_basic_threads();
+    create_new_priority_thread(log_twice, &a, 31);
+    create_new_deadline_thread(log_twice, &b, 3000000);
+    create_new_deadline_thread(log_twice, &c, 1000000);
+    create_new_deadline_thread(log_twice, &d, 2000000);
+    schedule_threads();
+    CuAssertStrEquals(tc, "ccddbbaa", run_order);
+}
+
+void create_priority_thread_and_yield()
+{
+    log_run('a');
+    create_new_priority_thread(log_twice, &c, 1);
+    yield();
+    log_run('a');
+}
+
+void test_6urgent_thread_runs_at_next_yield(CuTest *tc) {
+    run_order[0] = '\0';
+    initialize_basic_threads();
+    create_new_thread(create_priority_thread_and_yield);
+    create_new_parameterized_thread(log_twice, &b);
+    schedule_threads();
+    CuAssertStrEquals(tc, "accbab", run_order);
+}
+
+void sleep_then_log(void* name)
+{
+    // the thread's name doubles as how many ms to sleep
+    uthread_sleep_us((*(char*) name - 'a' + 1) * 1000);
+    log_run(*(char*) name);
+}
+
+void test_6sleepers_wake_in_deadline_order(CuTest *tc) {
+    run_order[0] = '\0';
+    initialize_basic_threads();
+    create_new_parameterized_thread(sleep_then_log, &c);
+    create_new_parameterized_thread(sleep_then_log, &a);
+    create_new_parameterized_thread(sleep_then_log, &b);
+    // d never sleeps, so runs while the others are asleep
+    create_new_parameterized_thread(log_twice, &d);
+    schedule_threads();
+    CuAssertStrEquals(tc, "ddabc", run_order);
+}
+
+uthread_sem sem;
+int timedwait_results;
+
+void wait_briefly()
+{
+    // nobody posts for a while so this gives up
+    if(!uthread_sem_timedwait(&sem, 500)) {
+        timedwait_results += 1;
+    }
+}
+
+void wait_long()
+{
+    if(uthread_sem_timedwait(&sem, 1000000)) {
+        timedwait_results += 10;
+    }
+}
+
+void post_after_sleep()
+{
+    uthread_sleep_us(3000);
+    uthread_sem_post(&sem);
+}
+
+void test_6sem_timedwait(CuTest *tc) {
+    timedwait_results = 0;
+    initialize_basic_threads();
+    uthread_sem_init(&sem, 0);
+    create_new_thread(wait_briefly);
+    create_new_thread(wait_long);
+    create_new_thread(post_after_sleep);
+    schedule_threads();
+    CuAssertIntEquals(tc, 11, timedwait_results);
+    CuAssertIntEquals(tc, 0, sem.value);
+}
+
+// a coroutine version of log_twice
+bool log_twice_coroutine(int* resume, void* name)
+{
+    COROUTINE_BEGIN(resume);
+    log_run(*(char*) name);
+    COROUTINE_YIELD(resume);
+    log_run(*(char*) name);
+    COROUTINE_END(resume);
+}
+
+void test_6coroutines_take_turns_with_threads(CuTest *tc) {
+    run_order[0] = '\0';
+    initialize_basic_threads();
+    create_new_coroutine(log_twice_coroutine, &c);
+    create_new_parameterized_thread(log_twice, &a);
+    create_new_coroutine(log_twice_coroutine, &d);
+    create_new_parameterized_thread(log_twice, &b);
+    schedule_threads();
+    // each pass over the threads is followed by a pass over the
+    // coroutines
+    CuAssertStrEquals(tc, "abcdabcd", run_order);
+}
+
+struct counter_task {
+    int i;
+    int total;
+};
+
+int flag_set;
+
+bool wait_for_flag_then_count(int* resume, void* parameter)
+{
+    struct counter_task* task = parameter;
+    COROUTINE_BEGIN(resume);
+    COROUTINE_WAIT_UNTIL(resume, flag_set);
+    for(task->i = 0; task->i < 10; task->i++) {
+        task->total += task->i;
+        COROUTINE_YIELD(resume);
+    }
+    COROUTINE_END(resume);
+}
+
+void set_flag_after_yields()
+{
+    for(int i = 0; i < 5; i++) {
+        yield();
+    }
+    flag_set = 1;
+}
+
+#define NUM_COUNTER_TASKS 10000
+
+struct counter_task counter_tasks[NUM_COUNTER_TASKS];
+
+void test_6many_coroutines(CuTest *tc) {
+    flag_set = 0;
+    initialize_basic_threads();
+    for(int i = 0; i < NUM_COUNTER_TASKS; i++) {
+        counter_tasks[i].total = 0;
+        create_new_coroutine(wait_for_flag_then_count, &counter_tasks[i]);
+    }
+    create_new_thread(set_flag_after_yields);
+    schedule_threads();
+    for(int i = 0; i < NUM_COUNTER_TASKS; i++) {
+        CuAssertIntEquals(tc, 45, counter_tasks[i].total);
+    }
+}
+
+void exit_with_parameter(void* value)
+{
+    yield();
+    uthread_exit(value);
+}
+
+void return_quickly()
+{
+}
+
+long joined;
+
+void join_both(void* unused)
+{
+    // the first is still running when we join, the second has already
+    // finished by the time we get to it
+    uthread_t slow = create_new_parameterized_thread(exit_with_parameter, (void*) 42L);
+    uthread_t quick = create_new_thread(return_quickly);
+    yield();
+    void* result = NULL;
+    uthread_join(slow, &result);
+    joined = (long) result;
+    result = (void*) 1L;
+    uthread_join(quick, &result);
+    if(result == NULL) {
+        joined += 1000;
+    }
+}
+
+void test_6join_collects_results(CuTest *tc) {
+    joined = 0;
+    initialize_basic_threads();
+    create_new_parameterized_thread(join_both, NULL);
+    schedule_threads();
+    CuAssertIntEquals(tc, 1042, joined);
+}
+
+// fan out and in like parallel_add.c in the sample exams, but on user
+// threads and without a global total
+#define DIGITS "31415926535897932384626433832795028841971"
+#define CHUNK_SIZE 4
+
+void* sum_digits(void* chunk)
+{
+    long sum = 0;
+    for(int i = 0; i < CHUNK_SIZE && ((char*) chunk)[i] != '\0'; i++) {
+        sum += ((char*) chunk)[i] - '0';
+        yield();
+    }
+    return (void*) sum;
+}
+
+long digit_total;
+
+void sum_all_digits()
+{
+    uthread_future* parts[sizeof DIGITS / CHUNK_SIZE + 1];
+    int num_parts = 0;
+    for(int i = 0; i < sizeof DIGITS - 1; i += CHUNK_SIZE) {
+        parts[num_parts++] = uthread_async(sum_digits, DIGITS + i);
+    }
+    for(int i = 0; i < num_parts; i++) {
+        digit_total += (long) uthread_await(parts[i]);
+    }
+}
+
+void test_6futures_fan_out_and_in(CuTest *tc) {
+    digit_total = 0;
+    initialize_basic_threads();
+    create_new_thread(sum_all_digits);
+    schedule_threads();
+    CuAssertIntEquals(tc, 195, digit_total);
+}
+
+void yield_3_times()
+{
+    for(int i = 0; i < 3; i++) {
+        yield();
+    }
+}
+
+void test_6trace_counts_switches(CuTest *tc) {
+    initialize_basic_threads();
+    create_new_thread(yield_3_times);
+    create_new_thread(yield_3_times);
+    uthread_trace_start();
+    schedule_threads();
+    uthread_trace_stop();
+    uthread_stats stats;
+    for(int i = 0; i < 2; i++) {
+        CuAssertTrue(tc, uthread_trace_stats(i, &stats));
+        // switched in once to start and once after each yield
+        CuAssertIntEquals(tc, 4, stats.switches);
+        CuAssertTrue(tc, stats.cpu_us > 0);
+        // each turn waits for the other thread's
+        CuAssertTrue(tc, stats.wait_us > 0);
+    }
+    CuAssertTrue(tc, !uthread_trace_stats(2, &stats));
+}
+
 
 int main(int argc, char *argv[]) {
 
@@ -187,6 +478,17 @@ int main(int argc, char *argv[]) {
 
     switch(level) {
     case 6:
+        SUITE_ADD_TEST(suite, test_6priority_runs_before_round_robin);
+        SUITE_ADD_TEST(suite, test_6priority_levels);
+        SUITE_ADD_TEST(suite, test_6earliest_deadline_first);
+        SUITE_ADD_TEST(suite, test_6urgent_thread_runs_at_next_yield);
+        SUITE_ADD_TEST(suite, test_6sleepers_wake_in_deadline_order);
+        SUITE_ADD_TEST(suite, test_6sem_timedwait);
+        SUITE_ADD_TEST(suite, test_6coroutines_take_turns_with_threads);
+        SUITE_ADD_TEST(suite, test_6many_coroutines);
+        SUITE_ADD_TEST(suite, test_6join_collects_results);
+        SUITE_ADD_TEST(suite, test_6futures_fan_out_and_in);
+        SUITE_ADD_TEST(suite, test_6trace_counts_switches);
     case 5:
         SUITE_ADD_TEST(suite, test_5);
     case 4:
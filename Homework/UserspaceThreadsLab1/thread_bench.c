@@ -0,0 +1,296 @@
+/*
+thread_bench - measures what it costs to create and finish a thread
+
+"all at once" creates every thread before schedule_threads runs, so
+the thread table has to grow to hold all of them.
+
+"churn" has one thread create short lived threads one at a time (like
+test 3 in tests.c), so finished threads' stacks get recycled.
+
+"stack" has every thread use a couple kB of stack and yield, then
+reports how much stack memory was really committed per thread at the
+peak (each thread reserves much more than that).
+
+"sleep" has every thread uthread_sleep_us a few times for a few to
+tens of ms, and reports the CPU time the scheduler spent per wakeup.
+Sleepers sit in a timer wheel, so a tick with nothing due costs next
+to nothing however many threads are asleep.
+
+"blocked" has every thread but two wait on a semaphore while those two
+yield back and forth, and reports the time per yield.  Ready threads
+are kept in a list, so the blocked ones cost nothing to skip.
+
+"coroutine" does the same as "stack" but with a million stackless
+coroutines from create_new_coroutine, each stepping a few times, and
+reports the time per step and the resident memory per coroutine at
+the peak.
+
+"all at once" also runs 100000 threads, more than vm.max_map_count
+(65530 by default) would allow if every stack's guard page took
+mappings of its own.
+
+    make thread_bench
+    ./thread_bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "basic_threads.h"
+
+// roughly what a thread with a few local buffers would use
+#define STACK_TOUCH 2048
+
+#define SLEEPS_PER_THREAD 5
+
+#define BLOCKED_YIELDS 200000
+
+#define NUM_COROUTINES 1000000
+#define STEPS_PER_COROUTINE 4
+
+int finished_count;
+int churn_total;
+size_t peak_committed;
+
+void quick_ending_thread()
+{
+    finished_count++;
+}
+
+void create_quick_threads()
+{
+    for(int i = 0; i < churn_total; i++) {
+        create_new_thread(quick_ending_thread);
+        yield();
+    }
+}
+
+void use_some_stack()
+{
+    volatile char buffer[STACK_TOUCH] __attribute__((unused));
+    for(int i = 0; i < STACK_TOUCH; i += 512) {
+        buffer[i] = i;
+    }
+    yield();
+    finished_count++;
+}
+
+void sleep_a_few_times(void* seed)
+{
+    long spread = (long) seed;
+    for(int i = 0; i < SLEEPS_PER_THREAD; i++) {
+        spread = (spread * 1103515245 + 12345) & 0x7fffffff;
+        uthread_sleep_us(2000 + spread % 30000);
+    }
+    finished_count++;
+}
+
+uthread_sem blocked_sem;
+int blocked_count;
+
+void wait_on_blocked_sem()
+{
+    uthread_sem_wait(&blocked_sem);
+    finished_count++;
+}
+
+void yield_past_blocked_threads()
+{
+    for(int i = 0; i < BLOCKED_YIELDS; i++) {
+        yield();
+    }
+    finished_count++;
+}
+
+// lets the waiters go once both yielders are done
+void release_blocked_threads()
+{
+    while(finished_count < 2) {
+        yield();
+    }
+    for(int i = 0; i < blocked_count; i++) {
+        uthread_sem_post(&blocked_sem);
+    }
+    finished_count++;
+}
+
+// created last, so by round robin every use_some_stack thread is
+// paused holding its stack when this runs
+void measure_stack()
+{
+    peak_committed = get_committed_stack_bytes();
+}
+
+size_t resident_bytes()
+{
+    long pages = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if(statm == NULL || fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+        perror("/proc/self/statm");
+        exit(1);
+    }
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+size_t peak_resident;
+
+struct step_counter {
+    int steps;
+};
+
+bool step_a_few_times(int* resume, void* parameter)
+{
+    struct step_counter* counter = parameter;
+    COROUTINE_BEGIN(resume);
+    while(counter->steps < STEPS_PER_COROUTINE) {
+        counter->steps++;
+        COROUTINE_YIELD(resume);
+    }
+    finished_count++;
+    COROUTINE_END(resume);
+}
+
+// like measure_stack, created last so every other coroutine is alive
+bool measure_resident(int* resume, void* parameter)
+{
+    peak_resident = resident_bytes();
+    return true;
+}
+
+double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void check_finished(int expected)
+{
+    if(finished_count != expected) {
+        printf("expected %d threads to finish but %d did\n", expected, finished_count);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    int counts[] = {1000, 10000, 25000};
+    int num_counts = sizeof counts / sizeof *counts;
+    // past vm.max_map_count / 2, to check guard pages don't cost mappings
+    int all_at_once_counts[] = {1000, 10000, 25000, 100000};
+    int num_all_at_once_counts = sizeof all_at_once_counts / sizeof *all_at_once_counts;
+
+    // first, so the memory it measures isn't left over from the others
+    printf("%-12s %10s %16s %22s\n", "mode", "coroutines", "ns per step",
+           "peak bytes/coroutine");
+    finished_count = 0;
+    struct step_counter* counters = calloc(NUM_COROUTINES, sizeof *counters);
+    size_t resident_before = resident_bytes();
+    initialize_basic_threads();
+    double start = now_seconds();
+    for(int j = 0; j < NUM_COROUTINES; j++) {
+        create_new_coroutine(step_a_few_times, &counters[j]);
+    }
+    create_new_coroutine(measure_resident, NULL);
+    schedule_threads();
+    double elapsed = now_seconds() - start;
+    check_finished(NUM_COROUTINES);
+    // includes the step_counter each one keeps its state in
+    printf("%-12s %10d %16.0f %22zu\n", "coroutine", NUM_COROUTINES,
+           elapsed * 1e9 / ((long) NUM_COROUTINES * (STEPS_PER_COROUTINE + 1)),
+           (peak_resident - resident_before) / NUM_COROUTINES);
+    free(counters);
+
+    printf("\n%-12s %10s %16s\n", "mode", "threads", "ns per thread");
+    for(int i = 0; i < num_all_at_once_counts; i++) {
+        int count = all_at_once_counts[i];
+        finished_count = 0;
+        initialize_basic_threads();
+        double start = now_seconds();
+        for(int j = 0; j < count; j++) {
+            create_new_thread(quick_ending_thread);
+        }
+        schedule_threads();
+        double elapsed = now_seconds() - start;
+        check_finished(count);
+        printf("%-12s %10d %16.0f\n", "all at once", count, elapsed * 1e9 / count);
+    }
+
+    for(int i = 0; i < num_counts; i++) {
+        finished_count = 0;
+        churn_total = counts[i] * 10;
+        initialize_basic_threads();
+        double start = now_seconds();
+        create_new_thread(create_quick_threads);
+        schedule_threads();
+        double elapsed = now_seconds() - start;
+        check_finished(churn_total);
+        printf("%-12s %10d %16.0f\n", "churn", churn_total, elapsed * 1e9 / churn_total);
+    }
+
+    printf("\n%-12s %10s %16s\n", "mode", "threads", "ns per yield");
+    for(int i = 0; i < num_counts; i++) {
+        finished_count = 0;
+        blocked_count = counts[i];
+        initialize_basic_threads();
+        uthread_sem_init(&blocked_sem, 0);
+        for(int j = 0; j < blocked_count; j++) {
+            create_new_thread(wait_on_blocked_sem);
+        }
+        create_new_thread(yield_past_blocked_threads);
+        create_new_thread(yield_past_blocked_threads);
+        create_new_thread(release_blocked_threads);
+        double start = now_seconds();
+        schedule_threads();
+        double elapsed = now_seconds() - start;
+        check_finished(blocked_count + 3);
+        // both yielders plus the releaser yield about as often
+        printf("%-12s %10d %16.0f\n", "blocked", blocked_count,
+               elapsed * 1e9 / (3.0 * BLOCKED_YIELDS));
+    }
+
+    printf("\n%-12s %10s %22s\n", "mode", "threads", "peak stack bytes/thread");
+    for(int i = 0; i < num_counts; i++) {
+        finished_count = 0;
+        initialize_basic_threads();
+        for(int j = 0; j < counts[i]; j++) {
+            create_new_thread(use_some_stack);
+        }
+        create_new_thread(measure_stack);
+        schedule_threads();
+        check_finished(counts[i]);
+        printf("%-12s %10d %22zu\n", "stack", counts[i], peak_committed / counts[i]);
+    }
+
+    printf("\n%-12s %10s %10s %16s\n", "mode", "threads", "seconds", "cpu ns per wake");
+    for(int i = 0; i < num_counts; i++) {
+        finished_count = 0;
+        initialize_basic_threads();
+        for(long j = 0; j < counts[i]; j++) {
+            create_new_parameterized_thread(sleep_a_few_times, (void*) j);
+        }
+        double start = now_seconds();
+        double start_cpu = cpu_seconds();
+        schedule_threads();
+        double elapsed = now_seconds() - start;
+        double cpu = cpu_seconds() - start_cpu;
+        check_finished(counts[i]);
+        printf("%-12s %10d %10.3f %16.0f\n", "sleep", counts[i], elapsed,
+               cpu * 1e9 / ((long) counts[i] * SLEEPS_PER_THREAD));
+    }
+
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("\nmax RSS: %ld kB\n", usage.ru_maxrss);
+}
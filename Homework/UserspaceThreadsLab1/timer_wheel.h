@@ -0,0 +1,160 @@
+/*
+timer_wheel.h - a hierarchical timer wheel for the thread schedulers
+
+Time is counted in ticks.  There are TIMER_WHEEL_LEVELS wheels of 64
+slots each: level 0 holds timers due within 64 ticks, one slot per
+tick; level 1 holds timers due within 64*64 ticks, one slot per 64
+ticks; and so on.  Every 64 ticks the next level 1 slot is cascaded,
+i.e. its timers are re-added and fall into level 0 (and likewise for
+the higher levels).  So adding or removing a timer is O(1) and
+advancing one tick only touches the timers that are due, however many
+timers are waiting.
+
+The timer struct is meant to be embedded in whatever is waiting (e.g.
+a thread); timer_wheel_advance hands the expired timers back to a
+callback that can get at the containing struct.
+
+Everything is static inline so each threads library can include this
+without another file to link.
+ */
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+// the furthest ahead a timer can be placed; later ones are parked in
+// the top level and re-placed when it cascades
+#define TIMER_WHEEL_SPAN (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+struct timer {
+    struct timer* next;
+    // the pointer that points at us, NULL if we're not in a wheel
+    struct timer** pprev;
+    unsigned long long expires;
+};
+
+struct timer_wheel {
+    // the next tick to be processed - everything earlier has fired
+    unsigned long long now;
+    int count;
+    struct timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+static inline void timer_wheel_init(struct timer_wheel* w, unsigned long long now) {
+    w->now = now;
+    w->count = 0;
+    for(int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for(int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            w->slots[level][i] = NULL;
+        }
+    }
+}
+
+static inline bool timer_pending(struct timer* t) {
+    return t->pprev != NULL;
+}
+
+static inline void timer_wheel_link(struct timer_wheel* w, struct timer* t) {
+    unsigned long long expires = t->expires < w->now ? w->now : t->expires;
+    unsigned long long delta = expires - w->now;
+    if(delta >= TIMER_WHEEL_SPAN) {
+        delta = TIMER_WHEEL_SPAN - 1;
+        expires = w->now + delta;
+    }
+    int level = 0;
+    while(delta >> (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    struct timer** slot = &w->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    t->next = *slot;
+    if(t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+}
+
+// adds t to fire once the wheel reaches tick t->expires
+static inline void timer_wheel_add(struct timer_wheel* w, struct timer* t) {
+    timer_wheel_link(w, t);
+    w->count++;
+}
+
+// takes a pending timer out without firing it
+static inline void timer_wheel_remove(struct timer_wheel* w, struct timer* t) {
+    *t->pprev = t->next;
+    if(t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+    w->count--;
+}
+
+static inline void timer_wheel_cascade(struct timer_wheel* w, int level) {
+    int index = (w->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    struct timer* t = w->slots[level][index];
+    w->slots[level][index] = NULL;
+    while(t != NULL) {
+        struct timer* next = t->next;
+        timer_wheel_link(w, t);
+        t = next;
+    }
+    if(index == 0 && level + 1 < TIMER_WHEEL_LEVELS) {
+        timer_wheel_cascade(w, level + 1);
+    }
+}
+
+/*
+timer_wheel_advance
+
+Processes every tick up to and including target, calling fire on each
+timer that expires (in order of ticks).  A timer is already removed
+from the wheel when fire is called, so fire may add it again.
+ */
+static inline void timer_wheel_advance(struct timer_wheel* w, unsigned long long target,
+                                       void (*fire)(struct timer*)) {
+    while(w->now <= target) {
+        if(w->count == 0) {
+            // nothing to fire or cascade, so skip straight there
+            w->now = target + 1;
+            return;
+        }
+        if((w->now & TIMER_WHEEL_MASK) == 0) {
+            timer_wheel_cascade(w, 1);
+        }
+        struct timer** slot = &w->slots[0][w->now & TIMER_WHEEL_MASK];
+        while(*slot != NULL) {
+            struct timer* t = *slot;
+            timer_wheel_remove(w, t);
+            fire(t);
+        }
+        w->now++;
+    }
+}
+
+/*
+timer_wheel_next_tick
+
+Returns a tick no later than the earliest pending timer's expiry, for
+deciding how long an idle scheduler can sleep.  Only level 0 is looked
+at, so if nothing is due before the next cascade that is what's
+returned.  Don't call it on an empty wheel.
+ */
+static inline unsigned long long timer_wheel_next_tick(struct timer_wheel* w) {
+    unsigned long long block_end = (w->now | TIMER_WHEEL_MASK) + 1;
+    for(unsigned long long tick = w->now; tick < block_end; tick++) {
+        if(w->slots[0][tick & TIMER_WHEEL_MASK] != NULL) {
+            return tick;
+        }
+    }
+    return block_end;
+}
+
+#endif
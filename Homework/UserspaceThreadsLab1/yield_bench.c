@@ -0,0 +1,65 @@
+/*
+yield_bench - measures the cost of one yield (thread -> scheduler ->
+next thread) for whichever context switch basic_threads.c was built
+with, first untraced and then with uthread_trace_start on.
+
+    make yield_bench yield_bench_fast
+    ./yield_bench        # ucontext (swapcontext)
+    ./yield_bench_fast   # fast_context.S
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "basic_threads.h"
+
+#define NUM_THREADS 4
+#define YIELDS_PER_THREAD 1000000
+
+long total_yields;
+
+void yield_a_lot()
+{
+    for(int i = 0; i < YIELDS_PER_THREAD; i++) {
+        yield();
+    }
+    total_yields += YIELDS_PER_THREAD;
+}
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run(bool traced)
+{
+    total_yields = 0;
+    initialize_basic_threads();
+    for(int i = 0; i < NUM_THREADS; i++) {
+        create_new_thread(yield_a_lot);
+    }
+
+    if(traced) {
+        uthread_trace_start();
+    }
+    double start = now_seconds();
+    schedule_threads();
+    double elapsed = now_seconds() - start;
+    if(traced) {
+        uthread_trace_stop();
+    }
+
+    if(total_yields != (long) NUM_THREADS * YIELDS_PER_THREAD) {
+        printf("expected %d yields but counted %ld\n", NUM_THREADS * YIELDS_PER_THREAD, total_yields);
+        exit(1);
+    }
+    printf("%-8s %ld yields in %.3f s: %.1f ns/yield\n", traced ? "traced" : "untraced",
+           total_yields, elapsed, elapsed * 1e9 / total_yields);
+}
+
+int main(int argc, char *argv[]) {
+
+    run(false);
+    run(true);
+}
@@ -0,0 +1,116 @@
+/*
+preempt_bench - what preemption costs at 100us time slices (rounded up
+to a kernel tick with the default cpu clock timers)
+
+Each scheduler pthread runs THREADS_PER_SCHEDULER threads that count
+to WORK and never yield.  The same work is run twice: once with slices
+so long nothing is ever preempted, and once with 100us slices.  The
+extra cpu time the second run takes, divided by the number of
+preemptions, is what one preemption costs.
+
+    gcc -O2 preempt_bench.c preempt_threads.c -o preempt_bench -pthread
+    gcc -O2 -DSLICE_CLOCK=CLOCK_MONOTONIC preempt_bench.c preempt_threads.c -o preempt_bench_monotonic -pthread
+    gcc -O2 -DUALARM_PREEMPT preempt_bench.c preempt_threads.c -o preempt_bench_ualarm -pthread
+    ./preempt_bench
+    ./preempt_bench_monotonic
+    ./preempt_bench_ualarm
+
+The default timers are on each pthread's cpu clock, which the kernel
+only checks once a tick, so their slices come out a tick long however
+short they are asked to be.  preempt_bench_monotonic gets real 100us
+slices.  With ualarm there is one SIGALRM for the whole process, so
+preempt_bench_ualarm only runs the single scheduler case.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include "preempt_threads.h"
+
+#define THREADS_PER_SCHEDULER 4
+#define WORK 500000000L
+#define SLICE_US 100
+#define NO_PREEMPT_US 100000000
+
+int slice_usecs;
+long preemptions[16];
+
+double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+void count_to_work()
+{
+    for(volatile long i = 0; i < WORK; i++) {
+    }
+}
+
+void* run_scheduler(void* arg)
+{
+    long index = (long) arg;
+    initialize_basic_threads();
+    for(int i = 0; i < THREADS_PER_SCHEDULER; i++) {
+        create_new_thread(count_to_work);
+    }
+    schedule_threads_with_preempt(slice_usecs);
+    preemptions[index] = preempt_count();
+    return NULL;
+}
+
+// returns the cpu time used, and the total preemptions in *preempted
+double run(int schedulers, int usecs, long* preempted)
+{
+    pthread_t pthreads[16];
+    slice_usecs = usecs;
+    double start = cpu_seconds();
+    for(long i = 0; i < schedulers; i++) {
+        pthread_create(&pthreads[i], NULL, run_scheduler, (void*) i);
+    }
+    *preempted = 0;
+    for(int i = 0; i < schedulers; i++) {
+        pthread_join(pthreads[i], NULL);
+        *preempted += preemptions[i];
+    }
+    return cpu_seconds() - start;
+}
+
+int main(int argc, char *argv[]) {
+
+#if defined(UALARM_PREEMPT)
+    int scheduler_counts[] = {1};
+    printf("ualarm, %dus slices\n", SLICE_US);
+#elif defined(SLICE_CLOCK)
+    int scheduler_counts[] = {1, 2, 4};
+    printf("per scheduler wall clock timers, %dus slices\n", SLICE_US);
+#else
+    int scheduler_counts[] = {1, 2, 4};
+    printf("per scheduler cpu clock timers, %dus slices asked for, "
+           "rounded up to a kernel tick (see mean slice)\n", SLICE_US);
+#endif
+    int num_counts = sizeof scheduler_counts / sizeof *scheduler_counts;
+
+    // only the schedulers' threads take alarms (the scheduler pthreads
+    // inherit this mask and unmask it just while a thread runs)
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    printf("%10s %12s %12s %12s %14s %10s %12s\n", "pthreads", "base cpu s",
+           "sliced cpu s", "preemptions", "mean slice us", "overhead", "ns/preempt");
+    for(int i = 0; i < num_counts; i++) {
+        int schedulers = scheduler_counts[i];
+        long unused, preempted;
+        double base = run(schedulers, NO_PREEMPT_US, &unused);
+        double sliced = run(schedulers, SLICE_US, &preempted);
+        double extra = sliced - base;
+        printf("%10d %12.3f %12.3f %12ld %14.1f %9.2f%% %12.0f\n", schedulers, base,
+               sliced, preempted, preempted ? sliced * 1e6 / preempted : 0.0,
+               extra * 100 / base, preempted ? extra * 1e9 / preempted : 0.0);
+    }
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
 #include "preempt_threads.h"
 #include "CuTest.h"
 
@@ -184,6 +185,119 @@ void test_7(CuTest *tc) {
     CuAssertIntEquals(tc, 30000, count2);
 }
 
+bool sleeper_woke;
+
+void sleep_then_set_flag()
+{
+    uthread_sleep_us(2000);
+    sleeper_woke = true;
+    count = count + 1;
+}
+
+void spin_until_sleeper_wakes()
+{
+    while(!sleeper_woke) { } // never yields, so needs preemption
+    count2 = count2 + 1;
+}
+
+void test_8(CuTest *tc) {
+    // sleeping must not stop the other threads, and a sleeper must
+    // still wake while another thread hogs the cpu
+    count = 0;
+    count2 = 0;
+    sleeper_woke = false;
+    initialize_basic_threads();
+    create_new_thread(sleep_then_set_flag);
+    create_new_thread(spin_until_sleeper_wakes);
+    schedule_threads_with_preempt(5);
+    CuAssertIntEquals(tc, 1, count);
+    CuAssertIntEquals(tc, 1, count2);
+}
+
+uthread_sem sem;
+
+void timedwait_nobody_posts()
+{
+    if(!uthread_sem_timedwait(&sem, 1000)) {
+        count = count + 1;
+    }
+    sleeper_woke = true;
+}
+
+void wait_for_post()
+{
+    uthread_sem_wait(&sem);
+    count2 = count2 + 1;
+}
+
+void post_after_timeout()
+{
+    while(!sleeper_woke) { }
+    uthread_sem_post(&sem);
+}
+
+void test_9(CuTest *tc) {
+    // one waiter times out, the other gets the post that comes later
+    count = 0;
+    count2 = 0;
+    sleeper_woke = false;
+    initialize_basic_threads();
+    uthread_sem_init(&sem, 0);
+    create_new_thread(timedwait_nobody_posts);
+    create_new_thread(wait_for_post);
+    create_new_thread(post_after_timeout);
+    schedule_threads_with_preempt(5);
+    CuAssertIntEquals(tc, 1, count);
+    CuAssertIntEquals(tc, 1, count2);
+}
+
+struct spin_pair {
+    volatile bool one_ran;
+    volatile bool two_ran;
+    int finished;
+};
+
+void spin_pair_one(void* arg)
+{
+    struct spin_pair* pair = arg;
+    pair->one_ran = true;
+    while(!pair->two_ran) { } // never yields, so needs preemption
+    pair->finished++;
+}
+
+void spin_pair_two(void* arg)
+{
+    struct spin_pair* pair = arg;
+    pair->two_ran = true;
+    while(!pair->one_ran) { }
+    pair->finished++;
+}
+
+void* run_spin_pair_scheduler(void* arg)
+{
+    initialize_basic_threads();
+    create_new_parameterized_thread(spin_pair_one, arg);
+    create_new_parameterized_thread(spin_pair_two, arg);
+    schedule_threads_with_preempt(100);
+    return NULL;
+}
+
+void test_10(CuTest *tc) {
+    // every pthread has its own scheduler and its own timer, so each
+    // one's threads get preempted whatever the others are doing
+    struct spin_pair pairs[3] = { 0 };
+    pthread_t schedulers[3];
+    for(int i = 0; i < 3; i++) {
+        pthread_create(&schedulers[i], NULL, run_spin_pair_scheduler, &pairs[i]);
+    }
+    for(int i = 0; i < 3; i++) {
+        pthread_join(schedulers[i], NULL);
+    }
+    for(int i = 0; i < 3; i++) {
+        CuAssertIntEquals(tc, 2, pairs[i].finished);
+    }
+}
+
 
 int main(int argc, char *argv[]) {
     
@@ -197,6 +311,9 @@ int main(int argc, char *argv[]) {
     SUITE_ADD_TEST(suite, test_5);
     SUITE_ADD_TEST(suite, test_6);
     SUITE_ADD_TEST(suite, test_7);
+    SUITE_ADD_TEST(suite, test_8);
+    SUITE_ADD_TEST(suite, test_9);
+    SUITE_ADD_TEST(suite, test_10);
     
 
     CuSuiteRun(suite);
@@ -0,0 +1,612 @@
+/*
+Preempt Threads - a rudimentary userspace threads library where
+threads that don't yield get preempted by SIGALRM
+
+Author: Buffalo (hewner@rose-hulman.edu) and you!
+
+Contrary to C convention (but for your convenience) we've documented
+these functions here in the .c file rather than the header.
+
+Alarm masking follows the rules in the README: alarms are masked in
+the scheduler, while thread structures are being changed, and around
+every swapcontext, and unmasked while threads run their own code.
+
+Every pthread that calls schedule_threads_with_preempt is a scheduler
+of its own: the thread table and the rest of the scheduler state are
+thread local, and each scheduler has a POSIX timer on its own CPU
+clock that sends SIGALRM to just that pthread.  So several pthreads
+can each preempt their own threads at once, where ualarm's SIGALRM
+goes to the whole process and could land on any of them.  Build with
+-DUALARM_PREEMPT for the old ualarm timing (one scheduler only), or
+with -DSLICE_CLOCK=CLOCK_MONOTONIC to time slices in wall clock time.
+
+ */
+#include <malloc.h>
+#include <ucontext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include "preempt_threads.h"
+#include "timer_wheel.h"
+
+// 64kB stack
+#define THREAD_STACK_SIZE 1024*64
+
+// starting size of the thread table - it doubles whenever it fills
+#define INITIAL_TABLE_SIZE 16
+
+// resolution of uthread_sleep_us and timed waits
+#define TICK_US 100
+
+struct thread {
+    ucontext_t context;
+    void* stack;
+    void (*fun_ptr)(void*);
+    void* parameter;
+    bool finished;
+    int index;
+    // next thread in the ready list
+    struct thread* next_ready;
+
+    // sleeping or waiting on a semaphore, so not to be scheduled
+    bool blocked;
+    // fires when a sleep or a timed wait is up
+    struct timer timer;
+    // the semaphore we're waiting on, and our neighbours in its queue
+    uthread_sem* waiting_on;
+    struct thread* next_waiter;
+    struct thread* prev_waiter;
+    bool timed_out;
+};
+
+#ifndef SLICE_CLOCK
+#define SLICE_CLOCK CLOCK_THREAD_CPUTIME_ID
+#endif
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// A NULL entry is an unused slot.  The table holds pointers so growing
+// it never moves a saved context.
+static __thread struct thread** threads;
+static __thread int table_size;
+
+// a stack of the unused slots' indexes, so finding one is O(1)
+static __thread int* free_slots;
+static __thread int free_count;
+
+// threads ready to run, in the order they take their turns, so picking
+// one costs the same however many are blocked or asleep
+static __thread struct thread* ready_head;
+static __thread struct thread* ready_tail;
+
+static __thread int current_thread_index;
+static __thread ucontext_t parent;
+
+// how long a thread runs before it is preempted
+static __thread int slice_usecs;
+
+#ifndef UALARM_PREEMPT
+// this scheduler's preemption timer
+static __thread timer_t slice_timer;
+#endif
+
+// number of times a thread was preempted, for measuring overhead
+static __thread long preemptions;
+
+// threads that are not finished (including blocked ones)
+static __thread int live_threads;
+
+// the timers of sleeping threads and timed waits, ticks counted from
+// clock_start_us
+static __thread struct timer_wheel sleepers;
+static __thread long long clock_start_us;
+
+static void block_alarms(sigset_t* old) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    if(sigprocmask(SIG_BLOCK, &mask, old) < 0) {
+        perror("sigprocmask");
+    }
+}
+
+static void restore_alarms(sigset_t* old) {
+    if(sigprocmask(SIG_SETMASK, old, NULL) < 0) {
+        perror("sigprocmask");
+    }
+}
+
+#ifdef UALARM_PREEMPT
+
+static void create_slice_timer() {
+}
+
+static void delete_slice_timer() {
+    signal(SIGALRM, SIG_IGN);
+}
+
+static void arm_slice_timer(int usecs) {
+    ualarm(usecs, 0);
+}
+
+#else
+
+// By default the timer counts this pthread's CPU time, so a slice isn't
+// used up while the kernel has the whole pthread descheduled.  But the
+// kernel only checks CPU clock timers on its scheduler tick, so slices
+// shorter than a tick (1-4ms) are rounded up to one.  A CLOCK_MONOTONIC
+// timer is exact but counts time the pthread wasn't running.
+static void create_slice_timer() {
+    struct sigevent event = { 0 };
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGALRM;
+    event.sigev_notify_thread_id = syscall(SYS_gettid);
+    if(timer_create(SLICE_CLOCK, &event, &slice_timer) < 0) {
+        perror("timer_create");
+        exit(1);
+    }
+}
+
+static void delete_slice_timer() {
+    timer_delete(slice_timer);
+}
+
+// one shot, so a thread that's preempted isn't preempted again while
+// the scheduler is still switching; 0 disarms it
+static void arm_slice_timer(int usecs) {
+    struct itimerspec slice = { 0 };
+    slice.it_value.tv_sec = usecs / 1000000;
+    slice.it_value.tv_nsec = usecs % 1000000 * 1000L;
+    if(timer_settime(slice_timer, 0, &slice, NULL) < 0) {
+        perror("timer_settime");
+    }
+}
+
+#endif
+
+// called on a thread's own stack once it is running again: the
+// thread's time slice only starts after the switch is done
+static void start_time_slice() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    if(sigprocmask(SIG_UNBLOCK, &mask, NULL) < 0) {
+        perror("sigprocmask");
+    }
+    // after unmasking, so the unmask doesn't eat into the slice
+    arm_slice_timer(slice_usecs);
+}
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// rounded up, so a thread never wakes early
+static unsigned long long tick_after_us(long usecs) {
+    return (now_us() + usecs - clock_start_us + TICK_US - 1) / TICK_US;
+}
+
+static int find_free_slot() {
+    if(free_count > 0) {
+        return free_slots[--free_count];
+    }
+    int new_size = table_size == 0 ? INITIAL_TABLE_SIZE : table_size * 2;
+    struct thread** bigger = realloc(threads, new_size * sizeof *threads);
+    int* bigger_free = realloc(free_slots, new_size * sizeof *free_slots);
+    if(bigger == NULL || bigger_free == NULL) {
+        printf("could not grow the thread table\n");
+        exit(1);
+    }
+    threads = bigger;
+    free_slots = bigger_free;
+    // pushed highest first so the new slots are handed out in order
+    for(int i = new_size - 1; i >= table_size; i--) {
+        threads[i] = NULL;
+        free_slots[free_count++] = i;
+    }
+    table_size = new_size;
+    return free_slots[--free_count];
+}
+
+static void release_thread(int index) {
+    free(threads[index]->stack);
+    free(threads[index]);
+    threads[index] = NULL;
+    live_threads--;
+    free_slots[free_count++] = index;
+}
+
+// alarms must be masked
+static void make_ready(struct thread* t) {
+    t->next_ready = NULL;
+    if(ready_head == NULL) {
+        ready_head = t;
+    } else {
+        ready_tail->next_ready = t;
+    }
+    ready_tail = t;
+}
+
+// returns NULL if no thread is ready
+static struct thread* ready_pop() {
+    struct thread* t = ready_head;
+    if(t != NULL) {
+        ready_head = t->next_ready;
+    }
+    return t;
+}
+
+static void waiter_remove(uthread_sem* sem, struct thread* t) {
+    if(t->prev_waiter != NULL) {
+        t->prev_waiter->next_waiter = t->next_waiter;
+    } else {
+        sem->first = t->next_waiter;
+    }
+    if(t->next_waiter != NULL) {
+        t->next_waiter->prev_waiter = t->prev_waiter;
+    } else {
+        sem->last = t->prev_waiter;
+    }
+    t->waiting_on = NULL;
+}
+
+static void timer_expired(struct timer* timer) {
+    struct thread* t = (struct thread*) ((char*) timer - offsetof(struct thread, timer));
+    if(t->waiting_on != NULL) {
+        waiter_remove(t->waiting_on, t);
+        t->timed_out = true;
+    }
+    t->blocked = false;
+    make_ready(t);
+}
+
+// called whenever the scheduler is about to pick a thread
+static void wake_expired_sleepers() {
+    if(sleepers.count > 0) {
+        timer_wheel_advance(&sleepers, (now_us() - clock_start_us) / TICK_US, timer_expired);
+    }
+}
+
+// nothing is runnable, so sleep the whole process until the next
+// timer could be due
+static void wait_for_sleepers() {
+    if(sleepers.count == 0) {
+        printf("deadlock: every thread is waiting on a semaphore\n");
+        exit(1);
+    }
+    long long wake_at = clock_start_us + timer_wheel_next_tick(&sleepers) * TICK_US;
+    long long delay = wake_at - now_us();
+    if(delay > 0) {
+        usleep(delay);
+    }
+}
+
+
+/*
+initialize_basic_threads
+
+Resets every global to a brand new clean state.  Called before any
+calls to create_new_thread or schedule_threads_with_preempt.
+ */
+void initialize_basic_threads() {
+    free(threads);
+    threads = NULL;
+    table_size = 0;
+    free(free_slots);
+    free_slots = NULL;
+    free_count = 0;
+    ready_head = NULL;
+    ready_tail = NULL;
+    live_threads = 0;
+    clock_start_us = now_us();
+    timer_wheel_init(&sleepers, 0);
+}
+
+/*
+create_new_thread
+
+Gets a new thread ready to run, but does not start it.  Can be called
+before scheduling starts or from inside a running thread.
+ */
+void create_new_thread(void (*fun_ptr)()) {
+    create_new_parameterized_thread((void (*)(void*)) fun_ptr, NULL);
+}
+
+static void thread_run_helper(int index) {
+    // threads are created with alarms masked (see below)
+    start_time_slice();
+    threads[index]->fun_ptr(threads[index]->parameter);
+    finish_thread();
+}
+
+/*
+create_new_parameterized_thread
+
+Works exactly like create_new_thread, except it expects a function
+that takes a void pointer as a paramter, plus a value for that
+parameter.
+
+The context is made with alarms masked, so switching to it for the
+first time can't be preempted halfway through.
+ */
+void create_new_parameterized_thread(void (*fun_ptr)(void*), void* parameter) {
+    sigset_t old;
+    block_alarms(&old);
+
+    int index = find_free_slot();
+    struct thread* t = malloc(sizeof(struct thread));
+    void* stack = malloc(THREAD_STACK_SIZE);
+    if(t == NULL || stack == NULL) {
+        printf("could not malloc a new thread\n");
+        exit(1);
+    }
+    t->fun_ptr = fun_ptr;
+    t->parameter = parameter;
+    t->finished = false;
+    t->index = index;
+    t->stack = stack;
+    t->blocked = false;
+    t->timer.pprev = NULL;
+    t->waiting_on = NULL;
+
+    getcontext(&t->context);
+    t->context.uc_stack.ss_sp = stack;
+    t->context.uc_stack.ss_size = THREAD_STACK_SIZE;
+    t->context.uc_link = NULL;
+    makecontext(&t->context, (void (*)()) thread_run_helper, 1, index);
+
+    threads[index] = t;
+    live_threads++;
+    make_ready(t);
+
+    restore_alarms(&old);
+}
+
+// Stops the running thread's alarm.  If it already went off while
+// masked, the signal is pending and would preempt the next thread the
+// moment it unmasks, so that's eaten too.  This doesn't wait: the
+// kernel may drop a disarmed timer's signal when it is taken, even
+// though sigpending still showed it.
+static void discard_alarm() {
+    arm_slice_timer(0);
+    sigset_t pending;
+    sigpending(&pending);
+    if(sigismember(&pending, SIGALRM)) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGALRM);
+        struct timespec no_wait = { 0, 0 };
+        sigtimedwait(&mask, NULL, &no_wait);
+    }
+}
+
+// the alarm handler - the "yield" for when the thread didn't
+static void catch_alarm(int sig_num) {
+    // SIGALRM is already masked inside its own handler, and returning
+    // from the handler unmasks it again, so no masking here
+    preemptions++;
+    swapcontext(&threads[current_thread_index]->context, &parent);
+    arm_slice_timer(slice_usecs);
+}
+
+/*
+schedule_threads_with_preempt
+
+Like schedule_threads, but a thread that runs for usecs microseconds
+without yielding is preempted and the next thread gets a turn.
+Returns once every thread has finished.
+
+By default slices are timed on the pthread's cpu clock, which the
+kernel only checks once a tick, so usecs is rounded up to a whole
+tick (1-4ms depending on the kernel's HZ, 4ms here).  Build with
+-DSLICE_CLOCK=CLOCK_MONOTONIC for slices of exactly usecs of wall
+clock time, which also count time the pthread wasn't running.
+
+Schedules the threads created from the calling pthread.  Other
+pthreads may be running schedulers of their own at the same time, but
+threads never move between them.
+*/
+void schedule_threads_with_preempt(int usecs) {
+    sigset_t old;
+    block_alarms(&old);
+    slice_usecs = usecs;
+    preemptions = 0;
+    create_slice_timer();
+    signal(SIGALRM, catch_alarm);
+
+    while(live_threads > 0) {
+        wake_expired_sleepers();
+        struct thread* t = ready_pop();
+        if(t == NULL) {
+            wait_for_sleepers();
+            continue;
+        }
+        current_thread_index = t->index;
+        swapcontext(&parent, &t->context);
+        discard_alarm();
+        if(t->finished) {
+            release_thread(t->index);
+        } else if(!t->blocked) {
+            // preempted or yielded, so back of the line
+            make_ready(t);
+        }
+    }
+
+    // the handler is for the whole process, so it stays installed in
+    // case another pthread is still scheduling
+    discard_alarm();
+    delete_slice_timer();
+    restore_alarms(&old);
+}
+
+/*
+preempt_count
+
+How many times threads were preempted in the last (or current) call to
+schedule_threads_with_preempt on this pthread.
+*/
+long preempt_count() {
+    return preemptions;
+}
+
+/*
+yield
+
+Gives up the rest of this thread's time slice.
+*/
+void yield() {
+    sigset_t old;
+    block_alarms(&old);
+    swapcontext(&threads[current_thread_index]->context, &parent);
+    start_time_slice();
+}
+
+/*
+finish_thread
+
+Like yield but the thread won't be scheduled again.  Called
+automatically when the thread function returns.
+*/
+void finish_thread() {
+    sigset_t old;
+    block_alarms(&old);
+    threads[current_thread_index]->finished = true;
+    swapcontext(&threads[current_thread_index]->context, &parent);
+}
+
+// alarms must already be masked
+static void block_current_thread() {
+    struct thread* t = threads[current_thread_index];
+    t->blocked = true;
+    swapcontext(&t->context, &parent);
+    start_time_slice();
+}
+
+/*
+uthread_sleep_us
+
+Puts the current thread to sleep for at least usecs microseconds
+while the other threads keep running (sleep or usleep would stop all
+of them).  Sleeps are rounded up to the next 100us tick.  A sleeping
+thread is woken the next time the scheduler picks a thread after it is
+due, which with preemption is at most one time slice later.
+*/
+void uthread_sleep_us(long usecs) {
+    sigset_t old;
+    block_alarms(&old);
+    struct thread* t = threads[current_thread_index];
+    t->timer.expires = tick_after_us(usecs);
+    timer_wheel_add(&sleepers, &t->timer);
+    block_current_thread();
+}
+
+// numbers the scheduler pthreads as they first use a semaphore.  Not
+// the address of something thread local, as a new pthread can get the
+// thread local storage of one that exited.
+static long last_scheduler_id;
+static __thread long scheduler_id;
+
+// The first scheduler to use sem claims it, with a compare and swap so
+// two can't both think they did.
+static void check_same_scheduler(uthread_sem* sem) {
+    if(scheduler_id == 0) {
+        scheduler_id = __atomic_add_fetch(&last_scheduler_id, 1, __ATOMIC_RELAXED);
+    }
+    long expected = 0;
+    if(!__atomic_compare_exchange_n(&sem->scheduler, &expected, scheduler_id, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) &&
+       expected != scheduler_id) {
+        printf("a uthread_sem was used by threads of two scheduler pthreads\n");
+        exit(1);
+    }
+}
+
+/*
+uthread_sem
+
+A counting semaphore for userspace threads.  Waiting blocks only the
+calling thread, and waiters are woken first come first served.  Alarms
+are masked inside each call, so these are safe against preemption.
+
+uthread_sem_timedwait gives up after timeout_us microseconds and
+returns false if it timed out, true if it got the semaphore.
+
+A semaphore belongs to the scheduler pthread whose threads first wait
+on it or post it, and only that scheduler's threads may use it after
+that, until it is initialized again.  The ready list and timer wheel
+a woken waiter goes back on are the poster's, and the count is only
+guarded by masking alarms, so another scheduler using it would race
+or run the waiter on a scheduler that doesn't hold it.  Any wait or
+post from another scheduler exits with an error.  Use a pthread
+semaphore between schedulers.
+*/
+void uthread_sem_init(uthread_sem* sem, int value) {
+    sem->value = value;
+    sem->first = NULL;
+    sem->last = NULL;
+    sem->scheduler = 0;
+}
+
+void uthread_sem_wait(uthread_sem* sem) {
+    uthread_sem_timedwait(sem, -1);
+}
+
+bool uthread_sem_timedwait(uthread_sem* sem, long timeout_us) {
+    sigset_t old;
+    block_alarms(&old);
+    check_same_scheduler(sem);
+    if(sem->value > 0 || timeout_us == 0) {
+        bool got_it = sem->value > 0;
+        if(got_it) {
+            sem->value--;
+        }
+        restore_alarms(&old);
+        return got_it;
+    }
+    struct thread* t = threads[current_thread_index];
+    t->waiting_on = sem;
+    t->timed_out = false;
+    t->next_waiter = NULL;
+    t->prev_waiter = sem->last;
+    if(sem->last != NULL) {
+        sem->last->next_waiter = t;
+    } else {
+        sem->first = t;
+    }
+    sem->last = t;
+    // a negative timeout means wait forever
+    if(timeout_us > 0) {
+        t->timer.expires = tick_after_us(timeout_us);
+        timer_wheel_add(&sleepers, &t->timer);
+    }
+    block_current_thread();
+    return !t->timed_out;
+}
+
+void uthread_sem_post(uthread_sem* sem) {
+    sigset_t old;
+    block_alarms(&old);
+    check_same_scheduler(sem);
+    struct thread* t = sem->first;
+    if(t == NULL) {
+        sem->value++;
+    } else {
+        // hand the count straight to the oldest waiter
+        waiter_remove(sem, t);
+        if(timer_pending(&t->timer)) {
+            timer_wheel_remove(&sleepers, &t->timer);
+        }
+        t->blocked = false;
+        make_ready(t);
+    }
+    restore_alarms(&old);
+}
@@ -9,6 +9,19 @@ these functions in the .c file rather than the header.
 You should not need to modify this header.
 
  */
+#include <stdbool.h>
+
+struct thread;
+
+// only usable by the threads of one scheduler pthread (see
+// uthread_sem_init in preempt_threads.c)
+typedef struct {
+    int value;
+    struct thread* first;
+    struct thread* last;
+    // the id of the scheduler pthread that first used it, or 0
+    long scheduler;
+} uthread_sem;
 
 void initialize_basic_threads();
 
@@ -18,6 +31,18 @@ void create_new_parameterized_thread(void (*fun_ptr)(void*), void* parameter);
 
 void schedule_threads_with_preempt(int usecs);
 
+long preempt_count();
+
 void yield();
 
 void finish_thread();
+
+void uthread_sleep_us(long usecs);
+
+void uthread_sem_init(uthread_sem* sem, int value);
+
+void uthread_sem_wait(uthread_sem* sem);
+
+bool uthread_sem_timedwait(uthread_sem* sem, long timeout_us);
+
+void uthread_sem_post(uthread_sem* sem);
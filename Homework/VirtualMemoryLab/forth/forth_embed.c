@@ -1,6 +1,21 @@
+#ifdef FORTH_PROFILE
+// for the registers in a signal's ucontext
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 
 #include "forth_embed.h"
 
@@ -14,6 +29,28 @@ extern void* name_SYSCALL0;
 
 static int32_t process_counter;
 
+// myjf.S finds these at fixed offsets
+_Static_assert(offsetof(struct forth_data, output_start) == 168, "OUTPUT_START in myjf.S");
+_Static_assert(offsetof(struct forth_data, output_end) == 176, "OUTPUT_END in myjf.S");
+_Static_assert(offsetof(struct forth_data, profile) == 184, "PROFILE in myjf.S");
+_Static_assert(offsetof(struct forth_data, jit) == 192, "JIT in myjf.S");
+_Static_assert(offsetof(struct forth_data, find_index_count) == 200, "FIND_INDEX_COUNT in myjf.S");
+_Static_assert(offsetof(struct forth_data, find_index) == 208, "FIND_INDEX in myjf.S");
+_Static_assert(offsetof(struct forth_profile, executions) == FORTH_PROFILE_SLOTS * 8,
+               "PROFILE_EXECUTIONS in myjf.S");
+_Static_assert(offsetof(struct forth_profile, current) == FORTH_PROFILE_SLOTS * 24,
+               "PROFILE_CURRENT in myjf.S");
+_Static_assert(offsetof(struct forth_jit, counts) == FORTH_JIT_SLOTS * 8, "JIT_COUNTS in myjf.S");
+_Static_assert(offsetof(struct forth_jit, threshold) == FORTH_JIT_SLOTS * 16, "JIT_THRESHOLD in myjf.S");
+_Static_assert(offsetof(struct forth_jit, hot_word) == FORTH_JIT_SLOTS * 16 + 8, "JIT_HOT_WORD in myjf.S");
+_Static_assert(offsetof(struct forth_jit, hot_branch) == FORTH_JIT_SLOTS * 16 + 16,
+               "JIT_HOT_BRANCH in myjf.S");
+_Static_assert(offsetof(struct forth_jit, resume) == FORTH_JIT_SLOTS * 16 + 24, "JIT_RESUME in myjf.S");
+
+static void jit_hot(struct forth_data *data, struct forth_jit *jit);
+static bool jit_uncompile_image(struct forth_data *data, struct forth_jit *jit, void* start,
+                                size_t size, int fd, off_t offset);
+
 void cfoo() {
     printf("cFOO\n");
 }
@@ -28,7 +65,12 @@ void initialize_forth_data(struct forth_data *data,
     *((void**)data->stack_top) = fstart;
 
     data->state = 0;
+    data->output_start = data->output_end = NULL;
+    data->profile = NULL;
+    data->jit = NULL;
     data->latest = name_SYSCALL0;
+    data->find_index_count = 0;
+    memset(data->find_index, 0, sizeof data->find_index);
     data->here = data_top;
     data->base = 10;
     data->process_id = ++process_counter;
@@ -43,65 +85,165 @@ void initialize_forth_data_expanded(struct forth_data_expanded *data) {
                           data->stack + sizeof data->stack / sizeof *(data->stack));
 }
 
+// fcontinue, compiling any words that get hot on the way
+static int64_t continue_forth(struct forth_data *data) {
+    int64_t result;
+    while((result = fcontinue(data)) == FCONTINUE_HOT_WORD) {
+        jit_hot(data, data->jit);
+    }
+    return result;
+}
+
 int64_t f_run(struct forth_data *data, char *input, char *output, int max_output_len) {
 
     if(output != NULL) {
 
         data->output_current = output;
         data->output_max = output + max_output_len - 1;
+        data->output_start = data->output_end = NULL;
     }
     if(input != NULL) {
         data->input_current = input;
     }
-    int64_t result = fcontinue(data);
-    *(data->output_current) = '\0';
+    int64_t result = continue_forth(data);
+    if(data->output_end == NULL) {
+        *(data->output_current) = '\0';
+    }
     return result;
 }
 
+/*
+Ring output
+
+The ring's undrained output runs from just after output_max up to
+output_current, wrapping at output_end.  EMIT pauses when
+output_current catches up with output_max, so one byte is always left
+free and an empty ring is never mistaken for a full one.
+ */
+void forth_output_to_ring(struct forth_data *data, char* ring, size_t size) {
+    data->output_start = data->output_current = ring;
+    data->output_end = ring + size;
+    data->output_max = data->output_end - 1;
+}
+
+bool forth_drain_output(struct forth_data *data, int fd) {
+    if(data->output_end == NULL) {
+        return true;
+    }
+    char* from = data->output_max + 1 == data->output_end ? data->output_start : data->output_max + 1;
+    char* to = data->output_current;
+    struct iovec pieces[2];
+    int count = 0;
+    if(to < from) {
+        // wrapped, so the end of the ring goes first
+        pieces[count++] = (struct iovec) { from, data->output_end - from };
+        from = data->output_start;
+    }
+    if(to > from) {
+        pieces[count++] = (struct iovec) { from, to - from };
+    }
+    bool ok = true;
+    while(fd >= 0 && count > 0) {
+        ssize_t written = writev(fd, pieces, count);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("forth output");
+            ok = false;
+            break;
+        }
+        // a short write leaves the rest of the pieces to go again
+        while(count > 0 && written >= pieces[0].iov_len) {
+            written -= pieces[0].iov_len;
+            pieces[0] = pieces[1];
+            count--;
+        }
+        if(count > 0) {
+            pieces[0].iov_base += written;
+            pieces[0].iov_len -= written;
+        }
+    }
+    data->output_max = to == data->output_start ? data->output_end - 1 : to - 1;
+    return ok;
+}
+
+char* map_forth_source(char* path, size_t* size) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0) {
+        perror(path);
+        if(fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    // mapping past the end of a file gives SIGBUS rather than zeros,
+    // so the '\0' comes from an anonymous mapping one byte longer
+    // than the file that the file is then mapped over
+    size_t page = getpagesize();
+    *size = (info.st_size + 1 + page - 1) / page * page;
+    char* source = mmap(NULL, *size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(source != MAP_FAILED && info.st_size > 0 &&
+       mmap(source, info.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(source, *size);
+        source = MAP_FAILED;
+    }
+    close(fd);
+    if(source == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+    return source;
+}
+
+void unmap_forth_source(char* source, size_t size) {
+    munmap(source, size);
+}
+
 void load_starter_forth_at_path(struct forth_data *mem, char* path) {
 
-    char input_buffer[200];
-    char output_buffer[200];
+    char output_ring[4096];
     char* orig_output = mem->output_current;
     char* orig_output_max = mem->output_max;
-    mem->output_current = output_buffer;
-    mem->output_max = output_buffer + sizeof output_buffer;
-    
-    FILE* file = fopen(path,"r");
-    if(file == NULL) {
+    char* orig_output_start = mem->output_start;
+    char* orig_output_end = mem->output_end;
+    forth_output_to_ring(mem, output_ring, sizeof output_ring);
+
+    // forth reads the whole file in one go, and only comes back for
+    // more at the end of it
+    size_t source_size;
+    char* source = map_forth_source(path, &source_size);
+    if(source == NULL) {
         printf("error loading %s\n", path);
         exit(1);
     }
+    mem->input_current = source;
 
-    int fresult = FCONTINUE_INPUT_DONE;
-    char* file_result = NULL;
-    
     while(1) {
-        
+
+        int fresult = continue_forth(mem);
         switch(fresult) {
-            
+
         case FCONTINUE_INPUT_DONE:
-            file_result = fgets(input_buffer, 200, file);
-            if(file_result == NULL) {
-                mem->output_current = orig_output;
-                mem->output_max = orig_output_max;
-                return;
-            }
-            mem->input_current = input_buffer;
-            break;
+            unmap_forth_source(source, source_size);
+            mem->output_current = orig_output;
+            mem->output_max = orig_output_max;
+            mem->output_start = orig_output_start;
+            mem->output_end = orig_output_end;
+            return;
         case FCONTINUE_OUTPUT_FLUSH:
-            //we ignore output, so just reset the output buffer
-            mem->output_current = output_buffer;
+            //we ignore output, so just empty the ring
+            forth_drain_output(mem, -1);
             break;
         case FCONTINUE_ERROR:
             printf("error %s load response.  (Maybe while handling %s?)\n", path, mem->wordbuf);
             exit(2);
-            
+
         default:
             printf("unexpected %s load response\n", path);
             exit(2);
         }
-        fresult = fcontinue(mem);
     }
     // code never arrives here
 }
@@ -109,3 +251,574 @@ void load_starter_forth_at_path(struct forth_data *mem, char* path) {
 void load_starter_forth(struct forth_data *mem) {
     load_starter_forth_at_path(mem, "jonesforth.f");
 }
+
+/*
+Forth images
+
+An image file is a header (padded to a page) followed by a copy of the
+forth's whole memory region, so restoring is a single copy on write
+mmap of the file at the address it came from (plus an anonymous one
+over the free space).  Pages that are all zero aren't written,
+which keeps the file sparse.  The region's pointers into the assembly
+code are only right for the program that saved it, so the header
+records where fstart was.  The JIT's code isn't in the region, so
+words it compiled are saved with DOCOL codewords, to run threaded.
+ */
+#define FORTH_IMAGE_MAGIC "FORTHIMG"
+
+struct forth_image_header {
+    char magic[8];
+    void* code;
+    void* start;
+    size_t size;
+    size_t data_offset;
+    struct forth_data data;
+};
+
+static size_t image_data_offset() {
+    size_t page = getpagesize();
+    return (sizeof(struct forth_image_header) + page - 1) / page * page;
+}
+
+static bool page_is_zero(char* page, size_t size) {
+    for(size_t i = 0; i < size; i++) {
+        if(page[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool save_forth_image(struct forth_data *mem, void* start, size_t size, char* path) {
+    static struct forth_image_header header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, FORTH_IMAGE_MAGIC, sizeof header.magic);
+    header.code = fstart;
+    header.start = start;
+    header.size = size;
+    header.data_offset = image_data_offset();
+    header.data = *mem;
+    // these point at the caller's buffers, not into the region
+    header.data.input_current = NULL;
+    header.data.output_current = header.data.output_max = NULL;
+    header.data.output_start = header.data.output_end = NULL;
+    header.data.profile = NULL;
+    header.data.jit = NULL;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if(fd < 0) {
+        perror(path);
+        return false;
+    }
+    bool ok = write(fd, &header, sizeof header) == sizeof header;
+    size_t page = getpagesize();
+    for(size_t done = 0; ok && done < size; done += page) {
+        size_t length = size - done < page ? size - done : page;
+        if(!page_is_zero(start + done, length)) {
+            ok = pwrite(fd, start + done, length, header.data_offset + done) == length;
+        }
+    }
+    ok = ok && ftruncate(fd, header.data_offset + size) == 0;
+    if(ok && mem->jit != NULL) {
+        ok = jit_uncompile_image(mem, mem->jit, start, size, fd, header.data_offset);
+    }
+    if(!ok) {
+        perror(path);
+    }
+    return close(fd) == 0 && ok;
+}
+
+bool restore_forth_image(struct forth_data *mem, char* path) {
+    static struct forth_image_header header;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+    if(read(fd, &header, sizeof header) != sizeof header ||
+       memcmp(header.magic, FORTH_IMAGE_MAGIC, sizeof header.magic) != 0 ||
+       header.code != fstart) {
+        printf("%s is not an image saved by this program\n", path);
+        close(fd);
+        return false;
+    }
+    void* result = mmap(header.start, header.size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_FIXED, fd, header.data_offset);
+    close(fd);
+    if(result == MAP_FAILED) {
+        perror("mmap forth image");
+        return false;
+    }
+    // nothing was saved between the heap and the stack, and new heap
+    // pages fault in much faster from anonymous memory than from the
+    // file's holes, so that part gets a fresh anonymous mapping
+    size_t page = getpagesize();
+    void* heap_end = (void*) (((uintptr_t) header.data.here + page - 1) / page * page);
+    void* stack_start = (void*) ((uintptr_t) header.data.stack_top / page * page);
+    if(heap_end >= header.start && stack_start <= header.start + header.size && heap_end < stack_start &&
+       mmap(heap_end, stack_start - heap_end, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
+        perror("mmap forth image");
+        return false;
+    }
+    *mem = header.data;
+    mem->process_id = ++process_counter;
+    return true;
+}
+
+// the codeword of the word whose dictionary header is at header: just
+// past the link, the length byte and the name, 8 byte aligned
+static void** header_codeword(char* header) {
+    int length = header[8] & 0x1f;
+    return (void**) (((uintptr_t) header + 9 + length + 7) & ~7);
+}
+
+#ifdef FORTH_PROFILE
+/*
+Profiling
+
+myjf.S counts each word as NEXT runs it and keeps the index of the
+running one in the profile's current.  So the SIGPROF handler only
+has to check it interrupted the forth code rather than C, and add a
+sample to that word.
+
+The handler runs on its own stack.  Forth's %rsp is its data stack,
+which is only 4000 bytes with the heap right under it, and a signal
+frame can be bigger than that.
+ */
+extern char forth_code_start[];
+extern char forth_code_end[];
+
+static struct forth_profile* sampled_profile;
+
+static void profile_sample(int signal, siginfo_t* info, void* context) {
+    struct forth_profile* profile = sampled_profile;
+    char* rip = (char*) ((ucontext_t*) context)->uc_mcontext.gregs[REG_RIP];
+    if(profile == NULL) {
+        return;
+    }
+    if(rip < forth_code_start || rip >= forth_code_end) {
+        profile->outside_samples++;
+    } else if(profile->current < 0) {
+        profile->lost_samples++;
+    } else {
+        profile->samples[profile->current]++;
+    }
+}
+
+void forth_profile_start(struct forth_data *data, struct forth_profile *profile) {
+    memset(profile, 0, sizeof *profile);
+    profile->current = -1;
+    sampled_profile = profile;
+    data->profile = profile;
+
+    // keep any alternate stack the program already has
+    stack_t old_stack;
+    if(sigaltstack(NULL, &old_stack) == 0 && (old_stack.ss_flags & SS_DISABLE)) {
+        static char* signal_stack;
+        size_t size = SIGSTKSZ;
+        if(signal_stack == NULL) {
+            signal_stack = malloc(size);
+        }
+        stack_t ss = { .ss_sp = signal_stack, .ss_size = size };
+        if(signal_stack == NULL || sigaltstack(&ss, NULL) != 0) {
+            perror("giving the forth profiler a signal stack");
+            return;
+        }
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_sigaction = profile_sample;
+    action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    struct itimerval timer = { { 0, FORTH_PROFILE_US }, { 0, FORTH_PROFILE_US } };
+    if(sigaction(SIGPROF, &action, NULL) != 0 || setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        perror("starting the forth profiler");
+    }
+}
+
+void forth_profile_stop(struct forth_data *data) {
+    struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sampled_profile = NULL;
+    data->profile = NULL;
+}
+
+// the newest dictionary header whose codeword is at codeword, or NULL
+static char* profile_word_header(struct forth_data *data, void* codeword) {
+    for(char* header = data->latest; header != NULL; header = *(char**) header) {
+        if(header_codeword(header) == codeword) {
+            return header;
+        }
+    }
+    return NULL;
+}
+
+struct profile_row {
+    void* codeword;
+    int64_t executions;
+    int64_t samples;
+};
+
+static int by_samples_then_executions(const void* a, const void* b) {
+    const struct profile_row *x = a, *y = b;
+    if(x->samples != y->samples) {
+        return x->samples < y->samples ? 1 : -1;
+    }
+    return (x->executions < y->executions) - (x->executions > y->executions);
+}
+
+void forth_profile_report(struct forth_data *data, struct forth_profile *profile, FILE* out) {
+    static struct profile_row rows[FORTH_PROFILE_SLOTS];
+    int num_rows = 0;
+    int64_t total = profile->outside_samples + profile->lost_samples;
+    for(int i = 0; i < FORTH_PROFILE_SLOTS; i++) {
+        if(profile->codewords[i] != NULL) {
+            rows[num_rows].codeword = profile->codewords[i];
+            rows[num_rows].executions = profile->executions[i];
+            rows[num_rows].samples = profile->samples[i];
+            total += profile->samples[i];
+            num_rows++;
+        }
+    }
+    qsort(rows, num_rows, sizeof *rows, by_samples_then_executions);
+
+    double percent = total > 0 ? 100.0 / total : 0;
+    fprintf(out, "%-20s %14s %10s %8s\n", "word", "executions", "samples", "time");
+    for(int i = 0; i < num_rows; i++) {
+        char* header = profile_word_header(data, rows[i].codeword);
+        if(header != NULL) {
+            fprintf(out, "%-20.*s", header[8] & 0x1f, header + 9);
+        } else {
+            fprintf(out, "%-20p", rows[i].codeword);
+        }
+        fprintf(out, " %14ld %10ld %7.1f%%\n", (long) rows[i].executions, (long) rows[i].samples,
+                rows[i].samples * percent);
+    }
+    fprintf(out, "%-20s %14s %10ld %7.1f%%\n", "(outside forth)", "", (long) profile->outside_samples,
+            profile->outside_samples * percent);
+    if(profile->lost_samples > 0) {
+        fprintf(out, "%-20s %14s %10ld %7.1f%%\n", "(table full)", "", (long) profile->lost_samples,
+                profile->lost_samples * percent);
+    }
+}
+#endif
+
+/*
+The JIT
+
+myjf.S counts calls and loops and pauses forth when one gets hot (see
+_JIT_COUNT).  jit_compile then translates the colon definition cell by
+cell into machine code that does the same things to the same stacks,
+so forth can go from one to the other in the middle of a word:
+
+    start     push %rsi on the return stack, like DOCOL
+    LIT n     push the number from its cell (TO changes VALUEs there)
+    BRANCH    jmp, and for 0BRANCH pop, test and jz (jnz after 0=)
+    EXIT      pop %rsi off the return stack and NEXT, like EXIT
+    DUP, +    a copy of the primitive's own code, up to its NEXT
+    others    point %rsi at two cells that lead back into the machine
+              code, and jump through the word's codeword
+
+Calling another word works just as it does from threaded code.  It
+runs threaded (or compiled), and its NEXT, or EXIT and NEXT, come back
+through the two cells.
+ */
+extern char DOCOL[], QUIT[], forth_code_start[], forth_code_end[];
+extern char LIT[], BRANCH[], ZBRANCH[], EXIT[], TICK[], LITSTRING[];
+
+// primitives that are straight line code that leaves %rsi alone, so
+// their code can be copied.  myjf.S ends each with INLINE_NEXT, which
+// puts a code_X_end label where its NEXT starts.
+#define JIT_INLINE_WORDS(X) \
+    X(DROP) X(SWAP) X(DUP) X(OVER) X(ROT) X(NROT) X(TWODROP) X(TWODUP) X(TWOSWAP) \
+    X(INCR) X(DECR) X(INCR8) X(DECR8) X(ADD) X(SUB) X(MUL) X(EQU) X(NEQU) X(LT) X(GT) \
+    X(LE) X(GE) X(ZEQU) X(ZNEQU) X(ZLT) X(ZGT) X(ZLE) X(ZGE) X(AND) X(OR) X(XOR) \
+    X(INVERT) X(TOR) X(FROMR) X(RDROP) X(STORE) X(FETCH) X(ADDSTORE) X(SUBSTORE) \
+    X(STOREBYTE) X(FETCHBYTE)
+
+#define JIT_DECLARE_INLINE(name) extern char name[], code_##name##_end[];
+JIT_INLINE_WORDS(JIT_DECLARE_INLINE)
+
+#define JIT_INLINE_ENTRY(name) { name, code_##name##_end },
+static struct {
+    char* word;
+    char* end;
+} jit_inline_words[] = {
+    JIT_INLINE_WORDS(JIT_INLINE_ENTRY)
+};
+
+#define JIT_MAX_CELLS 1024
+// more machine code than any one cell turns into
+#define JIT_MAX_CELL_CODE 64
+
+// the code of a primitive in jit_inline_words, setting *length to
+// where its NEXT starts, or NULL for any other word (or one too long
+// to copy)
+static unsigned char* jit_inline_code(void* word, int* length) {
+    for(size_t i = 0; i < sizeof jit_inline_words / sizeof *jit_inline_words; i++) {
+        if(word == jit_inline_words[i].word) {
+            unsigned char* code = *(unsigned char**) word;
+            *length = (unsigned char*) jit_inline_words[i].end - code;
+            return *length <= JIT_MAX_CELL_CODE ? code : NULL;
+        }
+    }
+    return NULL;
+}
+
+static void emit(unsigned char** at, const void* bytes, size_t length) {
+    memcpy(*at, bytes, length);
+    *at += length;
+}
+
+static void emit_int32(unsigned char** at, int32_t value) {
+    emit(at, &value, sizeof value);
+}
+
+static void emit_int64(unsigned char** at, int64_t value) {
+    emit(at, &value, sizeof value);
+}
+
+/*
+jit_compile
+
+Compiles the colon definition whose codeword is at cfa onto the end of
+the JIT's code, and returns where it starts, or NULL if it can't.  If
+loop_branch points at the offset of one of its backward branches,
+*resume is set to where that branch goes in the new code.
+ */
+static void* jit_compile(struct forth_jit *jit, void** cfa, void** loop_branch, void** resume) {
+    static const unsigned char docol[] = {
+        0x4d, 0x8d, 0x49, 0xf8,             // lea -8(%r9),%r9
+        0x49, 0x89, 0x31                    // mov %rsi,(%r9)
+    };
+    static const unsigned char exit[] = {
+        0x49, 0x8b, 0x31,                   // mov (%r9),%rsi
+        0x4d, 0x8d, 0x49, 0x08,             // lea 8(%r9),%r9
+        0x48, 0xad,                         // lodsq
+        0xff, 0x20                          // jmp *(%rax)
+    };
+    static const unsigned char pop_test[] = {
+        0x58,                               // pop %rax
+        0x48, 0x85, 0xc0                    // test %rax,%rax
+    };
+    static const unsigned char jz[] = { 0x0f, 0x84 }, jnz[] = { 0x0f, 0x85 }, jmp[] = { 0xe9 };
+    static bool is_target[JIT_MAX_CELLS + 1];
+    static int native[JIT_MAX_CELLS + 1];
+    static struct {
+        unsigned char* rel32;
+        int target;
+    } branches[JIT_MAX_CELLS];
+    void** body = cfa + 1;
+
+    // the definition ends at the first EXIT that no branch goes past
+    memset(is_target, 0, sizeof is_target);
+    int end = 0, furthest = 0;
+    while(1) {
+        if(end >= JIT_MAX_CELLS) {
+            return NULL;
+        }
+        char* word = body[end];
+        if(word == BRANCH || word == ZBRANCH) {
+            int64_t offset = (int64_t) body[end + 1];
+            int64_t target = end + 1 + offset / 8;
+            if(offset % 8 != 0 || target < 0 || target >= JIT_MAX_CELLS) {
+                return NULL;
+            }
+            is_target[target] = true;
+            if(target > furthest) {
+                furthest = target;
+            }
+            end += 2;
+        } else if(word == LIT) {
+            end += 2;
+        } else if(word == TICK || word == LITSTRING) {
+            return NULL;
+        } else {
+            end++;
+            if(word == EXIT && end > furthest) {
+                break;
+            }
+        }
+    }
+
+    unsigned char* start = (unsigned char*) jit->code + jit->code_used;
+    unsigned char* limit = (unsigned char*) jit->code + FORTH_JIT_CODE_SIZE;
+    unsigned char* at = start;
+    int num_branches = 0;
+    if(limit - at < JIT_MAX_CELL_CODE) {
+        return NULL;
+    }
+    emit(&at, docol, sizeof docol);
+    for(int i = 0; i <= end; i++) {
+        // operands and cells folded into the one before aren't
+        // somewhere to branch to
+        native[i] = -1;
+    }
+    for(int i = 0; i < end; ) {
+        if(limit - at < JIT_MAX_CELL_CODE) {
+            return NULL;
+        }
+        native[i] = at - start;
+        char* word = body[i];
+        unsigned char* code;
+        int length;
+        if(word == ZEQU && body[i + 1] == ZBRANCH && !is_target[i + 1]) {
+            emit(&at, pop_test, sizeof pop_test);
+            emit(&at, jnz, sizeof jnz);
+            branches[num_branches].target = i + 2 + (int64_t) body[i + 2] / 8;
+            branches[num_branches++].rel32 = at;
+            emit_int32(&at, 0);
+            i += 3;
+        } else if(word == BRANCH || word == ZBRANCH) {
+            if(word == ZBRANCH) {
+                emit(&at, pop_test, sizeof pop_test);
+                emit(&at, jz, sizeof jz);
+            } else {
+                emit(&at, jmp, sizeof jmp);
+            }
+            branches[num_branches].target = i + 1 + (int64_t) body[i + 1] / 8;
+            branches[num_branches++].rel32 = at;
+            emit_int32(&at, 0);
+            i += 2;
+        } else if(word == LIT) {
+            // the number is loaded from its cell each time, as VALUE
+            // words are changed by TO writing to that cell
+            emit(&at, "\x48\xb8", 2);           // movabs $cell,%rax
+            emit_int64(&at, (int64_t) &body[i + 1]);
+            emit(&at, "\xff\x30", 2);           // push (%rax)
+            i += 2;
+        } else if(word == EXIT) {
+            emit(&at, exit, sizeof exit);
+            i++;
+        } else if((code = jit_inline_code(word, &length)) != NULL) {
+            emit(&at, code, length);
+            i++;
+        } else {
+            // the two cells go after the jump, 8 byte aligned
+            unsigned char* cells = (unsigned char*) (((uintptr_t) at + 22 + 7) & ~7);
+            emit(&at, "\x48\xbe", 2);           // movabs $cells,%rsi
+            emit_int64(&at, (int64_t) cells);
+            emit(&at, "\x48\xb8", 2);           // movabs $word,%rax
+            emit_int64(&at, (int64_t) word);
+            emit(&at, "\xff\x20", 2);           // jmp *(%rax)
+            while(at < cells) {
+                *at++ = 0x90;
+            }
+            // the word's NEXT loads the first, and jumps to the code
+            // address held in the second: just after them
+            emit_int64(&at, (int64_t) (cells + 8));
+            emit_int64(&at, (int64_t) (cells + 16));
+            i++;
+        }
+    }
+    for(int b = 0; b < num_branches; b++) {
+        int target = branches[b].target;
+        if(target < 0 || target >= end || native[target] < 0) {
+            return NULL;
+        }
+        int32_t rel = (start + native[target]) - (branches[b].rel32 + 4);
+        memcpy(branches[b].rel32, &rel, sizeof rel);
+    }
+    if(loop_branch != NULL) {
+        int64_t offset = loop_branch - body;
+        int64_t target = offset + (int64_t) *loop_branch / 8;
+        if(offset > 0 && offset < end && target >= 0 && target < end && native[target] >= 0) {
+            *resume = start + native[target];
+        }
+    }
+    jit->code_used = (at - (unsigned char*) jit->code + 15) & ~15;
+    return start;
+}
+
+// the codeword of the word with addr in its body, the newest one that
+// starts below it
+static void** jit_word_around(struct forth_data *data, void** addr) {
+    for(char* header = data->latest; header != NULL; header = *(char**) header) {
+        if(header < (char*) addr) {
+            void** cfa = header_codeword(header);
+            return cfa < addr ? cfa : NULL;
+        }
+    }
+    return NULL;
+}
+
+// compiles the word with its codeword at cfa and points the codeword
+// at the new code.  A word already compiled is compiled again for a
+// hot loop, to find where in the new code the loop goes
+static void jit_compile_word(struct forth_jit *jit, void** cfa, void** loop_branch) {
+    char* codeword = *cfa;
+    bool colon = codeword == DOCOL || (codeword >= jit->code && codeword < jit->code + FORTH_JIT_CODE_SIZE);
+    // assembly defined words can't be changed
+    bool in_heap = (char*) cfa < forth_code_start || (char*) cfa >= forth_code_end;
+    void* entry = colon && in_heap ? jit_compile(jit, cfa, loop_branch, &jit->resume) : NULL;
+    if(entry == NULL) {
+        jit->rejected++;
+        return;
+    }
+    *cfa = entry;
+    jit->compiled++;
+}
+
+// if cfa is in the image of start to start + size saved at offset in
+// fd and points at compiled code, writes DOCOL over it there
+static bool jit_uncompile_cell(struct forth_jit *jit, void** cfa, void* start, size_t size,
+                               int fd, off_t offset) {
+    if((void*) cfa < start || (void*) (cfa + 1) > start + size) {
+        return true;
+    }
+    char* codeword = *cfa;
+    if(codeword < jit->code || codeword >= jit->code + FORTH_JIT_CODE_SIZE) {
+        return true;
+    }
+    void* docol = DOCOL;
+    return pwrite(fd, &docol, sizeof docol, offset + ((char*) cfa - (char*) start)) == sizeof docol;
+}
+
+// puts DOCOL back in the saved codewords of every compiled word.  Words
+// compiled as they got called are in the counts table, and words
+// compiled for a hot loop are in the dictionary
+static bool jit_uncompile_image(struct forth_data *data, struct forth_jit *jit, void* start,
+                                size_t size, int fd, off_t offset) {
+    bool ok = true;
+    for(int i = 0; ok && i < FORTH_JIT_SLOTS; i++) {
+        ok = jit_uncompile_cell(jit, jit->addresses[i], start, size, fd, offset);
+    }
+    for(char* header = data->latest; ok && header != NULL; header = *(char**) header) {
+        ok = jit_uncompile_cell(jit, header_codeword(header), start, size, fd, offset);
+    }
+    return ok;
+}
+
+static void jit_hot(struct forth_data *data, struct forth_jit *jit) {
+    jit->resume = NULL;
+    if(jit->hot_word != NULL) {
+        jit_compile_word(jit, jit->hot_word, NULL);
+        jit->hot_word = NULL;
+    }
+    if(jit->hot_branch != NULL) {
+        void** cfa = jit_word_around(data, jit->hot_branch);
+        if(cfa != NULL) {
+            jit_compile_word(jit, cfa, jit->hot_branch);
+        }
+        jit->hot_branch = NULL;
+    }
+}
+
+bool forth_jit_start(struct forth_data *data, struct forth_jit *jit, int64_t threshold) {
+    // QUIT's codeword only holds the address of DOCOL when forth is
+    // indirect threaded
+    if(*(void**) QUIT != DOCOL) {
+        return false;
+    }
+    memset(jit, 0, sizeof *jit);
+    jit->threshold = threshold;
+    jit->code = mmap(NULL, FORTH_JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(jit->code == MAP_FAILED) {
+        perror("mmap forth jit");
+        return false;
+    }
+    data->jit = jit;
+    return true;
+}
@@ -1,8 +1,57 @@
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #define STACK_SIZE 1000
 #define DATA_AREA_SIZE 16384
 #define BUFFER_SIZE 128
+// slots in FIND's index, a power of 2 (see myjf.S)
+#define FIND_INDEX_SLOTS 4096
+// slots in a forth_profile, a power of 2 (see myjf.S)
+#define FORTH_PROFILE_SLOTS 4096
+// how often the profiler samples, in microseconds of cpu time
+#define FORTH_PROFILE_US 1000
+
+// slots in a forth_jit's table, a power of 2 (see myjf.S)
+#define FORTH_JIT_SLOTS 4096
+// bytes of machine code a forth_jit can hold
+#define FORTH_JIT_CODE_SIZE (1 << 20)
+
+// compiles hot colon definitions to machine code (see forth_jit_start)
+struct forth_jit {
+    // an open addressed table of how often each colon definition (by
+    // codeword address) has been called, and each loop (by the
+    // address of its backward branch's offset) has gone round
+    void* addresses[FORTH_JIT_SLOTS];
+    int64_t counts[FORTH_JIT_SLOTS];
+    int64_t threshold;
+    // what just got hot, and where a hot loop carries on
+    void* hot_word;
+    void* hot_branch;
+    void* resume;
+
+    char* code;
+    size_t code_used;
+    int64_t compiled;
+    int64_t rejected;
+};
+
+// what a forth built with -DFORTH_PROFILE has been doing, per word
+// (see forth_profile_start)
+struct forth_profile {
+    // an open addressed table on codeword address, filled in by
+    // myjf.S as each word first runs
+    void* codewords[FORTH_PROFILE_SLOTS];
+    int64_t executions[FORTH_PROFILE_SLOTS];
+    // SIGPROF samples taken while each word was the one running
+    int64_t samples[FORTH_PROFILE_SLOTS];
+    // index of the word running now, or -1
+    int64_t current;
+    // samples taken outside the forth code, and with a full table
+    int64_t outside_samples;
+    int64_t lost_samples;
+};
 
 struct forth_data {
 
@@ -30,6 +79,22 @@ struct forth_data {
     // made wordbuf output a '\0' after the currently read word so you
     // can print it like a C string (and also know the length)
     char wordbuf[33];
+
+    // the ring output goes to, if any (see forth_output_to_ring).
+    // output_end is NULL when output goes to f_run's buffer instead
+    char* output_start;
+    char* output_end;
+
+    // where a FORTH_PROFILE build counts words, or NULL
+    struct forth_profile* profile;
+    // compiles data's hot words, or NULL
+    struct forth_jit* jit;
+
+    // FIND's hash table from names to the newest dictionary header
+    // with each name (see myjf.S).  0 names means it hasn't been
+    // built yet.
+    int64_t find_index_count;
+    void* find_index[FIND_INDEX_SLOTS];
 };
 
 // an expanded struct with defaults for all the various data regions
@@ -53,11 +118,52 @@ void initialize_forth_data(struct forth_data *data,
 
 void initialize_forth_data_expanded(struct forth_data_expanded *data);
 
+// maps the file at path into memory with a '\0' after it, so forth
+// can take the whole file as one input instead of a line at a time.
+// Returns NULL (after printing why) if the file can't be read.
+// *size is what to pass unmap_forth_source when forth is done with it
+char* map_forth_source(char* path, size_t* size);
+void unmap_forth_source(char* source, size_t size);
+
 // completely loads functions from jonesforth.f
 // note: exits on error
 void load_starter_forth(struct forth_data *mem);
 void load_starter_forth_at_path(struct forth_data *mem, char* path);
 
+// saves a forth (usually one that has just loaded jonesforth.f) to an
+// image file: the struct and the memory from start to start + size,
+// which must hold its heap, stack and return stack.  Returns false if
+// the file can't be written
+bool save_forth_image(struct forth_data *mem, void* start, size_t size, char* path);
+
+// maps an image saved by save_forth_image back where it was saved
+// from, in one copy on write mmap, and sets up mem to run it.  Only
+// works in the same program that saved it.  Returns false if the
+// image can't be used, so the caller can load jonesforth.f instead
+bool restore_forth_image(struct forth_data *mem, char* path);
+
+// only in the FORTH_PROFILE build: starts counting the words data
+// runs in profile, and sampling which one is running every
+// FORTH_PROFILE_US of cpu time with SIGPROF.  Only one forth can be
+// sampled at once
+void forth_profile_start(struct forth_data *data, struct forth_profile *profile);
+void forth_profile_stop(struct forth_data *data);
+
+// prints a line per word data ran, most samples first, naming words
+// by looking their codewords up in data's dictionary
+void forth_profile_report(struct forth_data *data, struct forth_profile *profile, FILE* out);
+
+// from now on, compiles each colon definition data runs to machine
+// code once it has been called threshold times, or a loop in it has
+// gone round threshold times.  Primitives like DUP and + are copied
+// into the machine code, and other words are called through their
+// codewords as usual.  Words that read the cells after them (' and
+// LITSTRING, so ." and S") are left threaded.  Returns false if the
+// code can't be mapped, or forth is direct threaded, which the JIT
+// doesn't handle.  Images saved after this would point at machine
+// code that isn't saved with them
+bool forth_jit_start(struct forth_data *data, struct forth_jit *jit, int64_t threshold);
+
 void cfoo();
 
 // these are defined in assembly
@@ -71,9 +177,22 @@ extern void fstart();
 #define FCONTINUE_INPUT_DONE 2
 #define FCONTINUE_ERROR 3 // at this point, always a parse error
 #define FCONTINUE_OUTPUT_FLUSH 4
+// a word got hot (see forth_jit_start).  f_run deals with these itself
+#define FCONTINUE_HOT_WORD 5
+
+// sends output to a ring of size bytes rather than f_run's buffer.
+// Forth only pauses with FCONTINUE_OUTPUT_FLUSH when the ring is
+// full; call forth_drain_output then, and whenever else the output
+// should be seen.  Pass f_run an output buffer to stop using the ring
+void forth_output_to_ring(struct forth_data *data, char* ring, size_t size);
+
+// writes everything in the ring to fd, or throws it away if fd is
+// negative.  Returns false if the write fails
+bool forth_drain_output(struct forth_data *data, int fd);
 
 // this runs the "input" forth code, using the given buffer for output
 // if you set the input to NULL, it will leave any existing input
 // if you set the output to NULL, it will use the existing output
+// (which may be a ring from forth_output_to_ring)
 int64_t f_run(struct forth_data *data, char *input, char* output, int max_output_len);
 
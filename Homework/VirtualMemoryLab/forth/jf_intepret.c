@@ -6,13 +6,25 @@
 #include <stddef.h>
 #include "forth_embed.h"
 
+// forth's output collects here and is only written out when the ring
+// fills up, when we wait for the user to type, and when we're done
+static char output_ring[1 << 16];
+
+void show_output(struct forth_data_expanded *mem) {
+    fflush(stdout);
+    forth_drain_output(&mem->f, STDOUT_FILENO);
+}
+
 void executeForth(struct forth_data_expanded *mem, int argc, char** argv) {
     int currFile = 0;
     int fresult = FCONTINUE_INPUT_DONE;
     char* file_result = NULL;
-    char input_buffer[200], output_buffer[200];
+    char input_buffer[200];
     FILE* file = NULL;
-    bool buffer_flushed = true;
+    char* source = NULL;
+    size_t source_size = 0;
+
+    forth_output_to_ring(&mem->f, output_ring, sizeof output_ring);
 
     // TODO: needs to force a flush as we enter interative mode
     // which is not happening bcause the fgets occurs before the flush
@@ -24,13 +36,16 @@ void executeForth(struct forth_data_expanded *mem, int argc, char** argv) {
             fresult = f_run(&mem->f, NULL, NULL, 0);
             break;
         case FCONTINUE_INPUT_DONE:
+            if(source != NULL) {
+                // forth has read all of the last file
+                unmap_forth_source(source, source_size);
+                source = NULL;
+            }
             while(1) {
 
                 if(file == stdin) {
                     //always flush if we're interactive
-                    printf("%s", output_buffer);
-                    fflush(stdout);
-                    buffer_flushed = true;
+                    show_output(mem);
                 }
                 
                 if(file != NULL) {
@@ -43,26 +58,27 @@ void executeForth(struct forth_data_expanded *mem, int argc, char** argv) {
 
                     // useful if we crash on load
                     // printf("EVAL: %s", input_buffer);
-                    if(buffer_flushed) {
-                        // if we're interactive don't buffer ouput between lines
-                        fresult = f_run(&mem->f, input_buffer, output_buffer, sizeof output_buffer);
-                        buffer_flushed = false;
-                    } else {
-                        fresult = f_run(&mem->f, input_buffer, NULL, 0);
-                    }
+                    fresult = f_run(&mem->f, input_buffer, NULL, 0);
                     break;
                 } else {
 
                     currFile++;
 
                     if(currFile < argc) {
-                        file = fopen(argv[currFile],"r");
+                        // files are mapped and given to forth whole,
+                        // only stdin goes a line at a time
+                        source = map_forth_source(argv[currFile], &source_size);
+                        if(source != NULL) {
+                            fresult = f_run(&mem->f, source, NULL, 0);
+                            break;
+                        }
                     }
                     if(currFile == argc) {
                         file = stdin;
                     }
                     if(currFile > argc) {
                         //we have no more ways to get input
+                        show_output(mem);
                         return;
                     }
 
@@ -71,14 +87,16 @@ void executeForth(struct forth_data_expanded *mem, int argc, char** argv) {
             }
             break;
         case FCONTINUE_ERROR:
+            show_output(mem);
             printf("Error while processing command: %s\n", (char*) &mem->f.wordbuf);
             return;
         case FCONTINUE_OUTPUT_FLUSH:
-            printf("%s", output_buffer);
-            fflush(stdout);
-            fresult = f_run(&mem->f, NULL, output_buffer, sizeof output_buffer);
+            // the ring is full
+            show_output(mem);
+            fresult = f_run(&mem->f, NULL, NULL, 0);
             break;
         default:
+            show_output(mem);
             printf("Unknown forth result\n");
             return;
         }
@@ -95,7 +113,16 @@ int main(int argc, char** argv) {
                    MAP_ANON | MAP_PRIVATE, -1, 0);
     
     initialize_forth_data_expanded(mem);
+#ifdef FORTH_PROFILE
+    // the report goes to stderr, so it stays apart from forth's output
+    static struct forth_profile profile;
+    forth_profile_start(&mem->f, &profile);
+    executeForth(mem, argc, argv);
+    forth_profile_stop(&mem->f);
+    forth_profile_report(&mem->f, &profile, stderr);
+#else
     executeForth(mem, argc, argv);
+#endif
 
     return 0;
 }
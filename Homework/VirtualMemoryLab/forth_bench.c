@@ -0,0 +1,328 @@
+/*
+forth_bench - how fast the forth inner interpreter runs words
+
+First times loading jonesforth.f into a fresh forth, and restoring the
+loaded forth from an image file instead.  Then it times compiling an
+application of APP_WORDS colon definitions, each calling the one
+before.  Both are mostly INTERPRET reading words and looking each up
+with FIND, and the second gets slower the more words FIND has to look
+through.  Then runs a few
+loops and reports nanoseconds per forth word executed
+(every NEXT counts as a word).  When the kernel lets us count
+hardware events, it also reports instructions and cycles per word.
+
+    stack      paged_forth.c's "4999 5000" test scaled up to a stack of
+               a million numbers
+    countdown  a loop of primitives: 1- DUP 0= 0BRANCH
+    sum        adding up 1..n, a loop of 8 primitives
+    calls      the countdown loop calling a colon definition each time
+
+The indirect threaded build then runs the loops again with the JIT
+compiling the words to machine code (see forth_jit_start).  Their
+words are still counted as threaded code would run them.  Then it
+checks TO still changes a VALUE once the VALUE is compiled, and that
+an image saved with compiled words runs without the JIT's code.
+
+Last it times printing a million numbers to /dev/null, with output
+going through f_run's 200 byte buffer as jf_intepret.c used to, and
+through a 64k ring drained with forth_drain_output.  Forth pauses to
+have its output written every time the buffer or ring fills.
+
+Build the indirect and direct threaded versions and compare:
+
+    make bench
+    ./forth_bench.bin
+    ./forth_bench_dtc.bin
+
+forth_bench_dtc.bin uses myjf.S built with -DDIRECT_THREADED.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "forth/forth_embed.h"
+
+#define STACKHEAP_SIZE (16 * 1024 * 1024)
+#define RETURNSTACK_SIZE (64 * 1024)
+#define STACK_N 1000000L
+#define COUNTDOWN_N 20000000L
+#define CALLS_N 10000000L
+#define SUM_N 10000000L
+#define JIT_THRESHOLD 1000
+#define PRINT_N 1000000L
+#define RUNS 3
+#define LOADS 200
+#define APP_WORDS 2000
+#define IMAGE_PATH "forth_bench.img"
+// not IMAGE_PATH, which the restored memory is still mapped from
+#define JIT_IMAGE_PATH "forth_bench_jit.img"
+
+struct forth_data forth;
+char output[200];
+char output_ring[1 << 16];
+struct forth_jit jit;
+int instructions_fd = -1;
+int cycles_fd = -1;
+
+long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// a counter of a hardware event in user space, or -1 if we aren't
+// allowed (or there's no PMU, as in many VMs)
+int open_counter(int config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof attr;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long long read_counter(int fd)
+{
+    long long count = 0;
+    if(fd >= 0 && read(fd, &count, sizeof count) != sizeof count) {
+        count = 0;
+    }
+    return count;
+}
+
+void run_forth(char* input)
+{
+    int64_t result = f_run(&forth, input, output, sizeof output);
+    if(result != FCONTINUE_INPUT_DONE) {
+        printf("forth stopped with %ld running \"%s\" (%s)\n", (long) result, input, forth.wordbuf);
+        exit(1);
+    }
+}
+
+// runs input RUNS times and reports the best run, given how many
+// words each run executes.  Each run must print expected.
+void bench(const char* name, char* input, double words, const char* expected)
+{
+    long best_ns = 0;
+    long long best_instructions = 0, best_cycles = 0;
+    for(int i = 0; i < RUNS; i++) {
+        long long instructions = read_counter(instructions_fd);
+        long long cycles = read_counter(cycles_fd);
+        long start = now_ns();
+        run_forth(input);
+        long ns = now_ns() - start;
+        instructions = read_counter(instructions_fd) - instructions;
+        cycles = read_counter(cycles_fd) - cycles;
+        if(strcmp(output, expected) != 0) {
+            printf("%s printed \"%s\" rather than \"%s\"\n", name, output, expected);
+            exit(1);
+        }
+        if(i == 0 || ns < best_ns) {
+            best_ns = ns;
+            best_instructions = instructions;
+            best_cycles = cycles;
+        }
+    }
+    printf("%10s %12.0f %10.3f %10.2f", name, words, best_ns / 1e9, best_ns / words);
+    if(instructions_fd >= 0 && cycles_fd >= 0) {
+        printf(" %10.2f %10.2f\n", best_instructions / words, best_cycles / words);
+    } else {
+        printf(" %10s %10s\n", "-", "-");
+    }
+}
+
+void run_loops()
+{
+    char input[200], expected[50];
+    printf("%10s %12s %10s %10s %10s %10s\n", "loop", "words", "seconds", "ns/word", "insns/word",
+           "cycles/word");
+
+    // n USESTACK leaves n..0 on the stack in n turns of 5 words.
+    // t DROPUNTIL drops down to t, 4 words a turn
+    long n = STACK_N;
+    snprintf(input, sizeof input, " %ld USESTACK %ld DROPUNTIL %ld USESTACK %ld DROPUNTIL . . ",
+             n, n / 2, n / 5, n - 1);
+    snprintf(expected, sizeof expected, "%ld %ld ", n - 1, n);
+    double stack_words = 5.0 * n + 4.0 * (n / 2 + 1) + 5.0 * (n / 5) +
+        4.0 * ((n / 5 + 1) + (n - 1 - n / 2 + 1));
+    bench("stack", input, stack_words, expected);
+
+    snprintf(input, sizeof input, " %ld COUNTDOWN ", COUNTDOWN_N);
+    bench("countdown", input, 4.0 * COUNTDOWN_N, "");
+
+    snprintf(input, sizeof input, " %ld SUM . ", SUM_N);
+    snprintf(expected, sizeof expected, "%ld ", SUM_N * (SUM_N + 1) / 2);
+    bench("sum", input, 8.0 * SUM_N, expected);
+
+    // STEP is DOCOL's NEXT, 1- and EXIT
+    snprintf(input, sizeof input, " %ld CALLS ", CALLS_N);
+    bench("calls", input, 6.0 * CALLS_N, "");
+}
+
+// a VALUE keeps its number in its own LIT cell, where TO and +TO
+// change it, so compiled code has to keep reading that cell.  READ
+// loops long enough to get X compiled
+void check_values()
+{
+    run_forth(" 10 VALUE X : READ 0 BEGIN X DROP 1+ DUP 2000 = UNTIL DROP ; "
+              " READ X . 20 TO X X . 5 +TO X READ X . ");
+    if(strcmp(output, "10 20 25 ") != 0) {
+        printf("the VALUE X printed \"%s\" rather than \"10 20 25 \"\n", output);
+        exit(1);
+    }
+}
+
+// the compiled code isn't saved in an image, so the words check_values
+// and run_loops got compiled have to run threaded once it is restored.
+// Unmapping the code first makes any that don't crash
+void check_compiled_image(void* stackheap, struct forth_jit* jit)
+{
+    if(!save_forth_image(&forth, stackheap, STACKHEAP_SIZE + RETURNSTACK_SIZE, JIT_IMAGE_PATH)) {
+        exit(1);
+    }
+    munmap(jit->code, FORTH_JIT_CODE_SIZE);
+    if(!restore_forth_image(&forth, JIT_IMAGE_PATH)) {
+        exit(1);
+    }
+    run_forth(" READ X . 100 SUM . ");
+    if(strcmp(output, "25 5050 ") != 0) {
+        printf("the restored forth printed \"%s\" rather than \"25 5050 \"\n", output);
+        exit(1);
+    }
+}
+
+// prints PRINT_N numbers to fd through size bytes of f_run buffer or
+// ring, and reports how long it took and how often forth paused
+void bench_output(const char* name, bool ring, size_t size, int fd)
+{
+    char input[50];
+    snprintf(input, sizeof input, " %ld PRINTS ", PRINT_N);
+    long pauses = 0;
+    long start = now_ns();
+    int64_t result;
+    if(ring) {
+        forth_output_to_ring(&forth, output_ring, size);
+        result = f_run(&forth, input, NULL, 0);
+    } else {
+        result = f_run(&forth, input, output_ring, size);
+    }
+    while(1) {
+        if(ring) {
+            forth_drain_output(&forth, fd);
+        } else if(write(fd, output_ring, forth.output_current - output_ring) < 0) {
+            perror("write");
+            exit(1);
+        }
+        if(result != FCONTINUE_OUTPUT_FLUSH) {
+            break;
+        }
+        pauses++;
+        result = ring ? f_run(&forth, NULL, NULL, 0) : f_run(&forth, NULL, output_ring, size);
+    }
+    if(result != FCONTINUE_INPUT_DONE) {
+        printf("forth stopped with %ld printing\n", (long) result);
+        exit(1);
+    }
+    printf("%10s %10zu %10.3f %10ld\n", name, size, (now_ns() - start) / 1e9, pauses);
+}
+
+int main(int argc, char** argv)
+{
+    // colon definitions compiled at runtime run code out of the heap
+    // when forth is direct threaded, so it has to be executable.  The
+    // return stack comes right after, so an image is one region.
+    void* stackheap = mmap(NULL, STACKHEAP_SIZE + RETURNSTACK_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                           MAP_ANON | MAP_PRIVATE, -1, 0);
+    if(stackheap == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    void* returnstack = stackheap + STACKHEAP_SIZE;
+    long start = now_ns();
+    for(int i = 0; i < LOADS; i++) {
+        initialize_forth_data(&forth, returnstack + RETURNSTACK_SIZE, stackheap,
+                              stackheap + STACKHEAP_SIZE);
+        load_starter_forth_at_path(&forth, "forth/jonesforth.f");
+    }
+    printf("loading jonesforth.f takes %.1fus\n", (now_ns() - start) / 1e3 / LOADS);
+
+    if(!save_forth_image(&forth, stackheap, STACKHEAP_SIZE + RETURNSTACK_SIZE, IMAGE_PATH)) {
+        exit(1);
+    }
+    start = now_ns();
+    for(int i = 0; i < LOADS; i++) {
+        if(!restore_forth_image(&forth, IMAGE_PATH)) {
+            exit(1);
+        }
+    }
+    printf("restoring it from %s takes %.1fus\n", IMAGE_PATH, (now_ns() - start) / 1e3 / LOADS);
+    run_forth(" 1 2 + . ");
+    if(strcmp(output, "3 ") != 0) {
+        printf("the restored forth printed \"%s\" rather than \"3 \"\n", output);
+        exit(1);
+    }
+
+    char input[200], expected[50];
+    run_forth(" : W0 1+ ; ");
+    start = now_ns();
+    for(int i = 1; i < APP_WORDS; i++) {
+        snprintf(input, sizeof input, " : W%d W%d 1+ ; ", i, i - 1);
+        run_forth(input);
+    }
+    printf("compiling %d more words takes %.1fus\n", APP_WORDS, (now_ns() - start) / 1e3);
+    snprintf(input, sizeof input, " 0 W%d . ", APP_WORDS - 1);
+    run_forth(input);
+    snprintf(expected, sizeof expected, "%d ", APP_WORDS);
+    if(strcmp(output, expected) != 0) {
+        printf("the application printed \"%s\" rather than \"%s\"\n", output, expected);
+        exit(1);
+    }
+
+    run_forth(" : USESTACK BEGIN DUP 1- DUP 0= UNTIL ; "
+              " : DROPUNTIL BEGIN DUP ROT = UNTIL ; "
+              " : COUNTDOWN BEGIN 1- DUP 0= UNTIL DROP ; "
+              " : STEP 1- ; "
+              " : CALLS BEGIN STEP DUP 0= UNTIL DROP ; "
+              " : SUM 0 SWAP BEGIN SWAP OVER + SWAP 1- DUP 0= UNTIL DROP ; "
+              " : PRINTS BEGIN DUP . 1- DUP 0= UNTIL DROP ; ");
+
+    instructions_fd = open_counter(PERF_COUNT_HW_INSTRUCTIONS);
+    cycles_fd = open_counter(PERF_COUNT_HW_CPU_CYCLES);
+
+#ifdef DIRECT_THREADED
+    printf("direct threaded\n");
+#else
+    printf("indirect threaded\n");
+#endif
+    run_loops();
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if(null_fd < 0) {
+        perror("/dev/null");
+        exit(1);
+    }
+    printf("\n%10s %10s %10s %10s\n", "output", "bytes", "seconds", "pauses");
+    bench_output("buffer", false, sizeof output, null_fd);
+    bench_output("ring", true, sizeof output_ring, null_fd);
+
+    if(forth_jit_start(&forth, &jit, JIT_THRESHOLD)) {
+        printf("\njit, compiling after %d calls or turns of a loop\n", JIT_THRESHOLD);
+        run_loops();
+        check_values();
+        printf("%ld words compiled to %zu bytes, %ld left threaded\n", (long) jit.compiled,
+               jit.code_used, (long) jit.rejected);
+        check_compiled_image(stackheap, &jit);
+    }
+    return 0;
+}
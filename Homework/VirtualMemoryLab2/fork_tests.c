@@ -214,6 +214,25 @@ void test9_double_fork_copy_on_write(CuTest *tc) {
     CuAssertIntEquals(tc, 11, get_used_pages_count());
 }
 
+void test10_parallel(CuTest *tc) {
+    initialize_forths();
+    int forths[4];
+    forths[0] = create_forth(" 1 2 + . ");
+    forths[1] = create_forth(" 5 . YIELD 6 . ");
+    forths[2] = create_forth(": TESTFUNC FORK IF .\" parent \" ELSE .\" child \" THEN ; TESTFUNC ");
+    forths[3] = create_forth(" 2 BASE ! 1 1 + . ");
+    struct run_output results[4];
+    run_forths_in_parallel(forths, 4, 2, results);
+    CuAssertIntEquals(tc, FCONTINUE_INPUT_DONE, results[0].result_code);
+    CuAssertStrEquals(tc, "3 ", results[0].output);
+    CuAssertIntEquals(tc, FCONTINUE_INPUT_DONE, results[1].result_code);
+    CuAssertStrEquals(tc, "5 6 ", results[1].output);
+    // the child runs after the parent's turn ends at the fork
+    CuAssertIntEquals(tc, FCONTINUE_INPUT_DONE, results[2].result_code);
+    CuAssertStrEquals(tc, "child parent ", results[2].output);
+    CuAssertIntEquals(tc, FCONTINUE_INPUT_DONE, results[3].result_code);
+    CuAssertStrEquals(tc, "10 ", results[3].output);
+}
 
 int main(int argc, char *argv[]) {
     
@@ -233,6 +252,7 @@ int main(int argc, char *argv[]) {
     SUITE_ADD_TEST(suite, test7_copy_on_write);
     SUITE_ADD_TEST(suite, test8_copy_on_write_parent_edit);
     SUITE_ADD_TEST(suite, test9_double_fork_copy_on_write);
+    SUITE_ADD_TEST(suite, test10_parallel);
                                      
     CuSuiteRun(suite);
     CuSuiteSummary(suite, output);
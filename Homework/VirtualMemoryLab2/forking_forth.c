@@ -8,6 +8,7 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/wait.h>
 #include "forth/forth_embed.h"
 #include "forking_forth.h"
 
@@ -399,4 +400,136 @@ void push_onto_forth_stack(struct forth_data *data, int64_t value_to_push)
     data->stack_top -= 8; // stack is 8 bytes a entry, starts high,
                           // goes low
     *((int64_t *)data->stack_top) = current_top;
-}
\ No newline at end of file
+}
+// gives this process its own copy of the frames file, so its forths
+// can't step on another process's frames
+static void use_private_frames()
+{
+    size_t size = getpagesize() * NUM_PAGES * MAX_FORTHS;
+    char path[] = "bigmem_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0)
+    {
+        unlink(path); // gone once the worker exits
+    }
+    if (fd < 0 || write(fd, frames, size) != size)
+    {
+        perror("copying the frames");
+        exit(1);
+    }
+    char *copy = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_SHARED, fd, 0);
+    if (copy == MAP_FAILED)
+    {
+        perror("frame map failed");
+        exit(1);
+    }
+    munmap(frames, size);
+    close(frames_fd);
+    frames = copy;
+    frames_fd = fd;
+}
+
+// one worker process of run_forths_in_parallel: takes turns running
+// every forths[i] with i % workers == worker, and anything they fork
+static void run_worker(int *forths, int n, int worker, int workers, struct run_output *results)
+{
+    use_private_frames();
+    int queue[MAX_FORTHS];
+    int root[MAX_FORTHS]; // the index in forths of each forth's ancestor
+    int head = 0, count = 0;
+    for (int i = worker; i < n; i += workers)
+    {
+        queue[(head + count++) % MAX_FORTHS] = forths[i];
+        root[forths[i]] = i;
+    }
+    while (count > 0)
+    {
+        int forth = queue[head];
+        head = (head + 1) % MAX_FORTHS;
+        count--;
+        struct run_output output = run_forth_until_event(forth);
+        struct run_output *result = &results[root[forth]];
+        size_t used = strlen(result->output);
+        snprintf(result->output + used, sizeof result->output - used, "%s", output.output);
+        switch (output.result_code)
+        {
+        case FCONTINUE_FORK:
+            root[output.forked_child_id] = root[forth];
+            queue[(head + count++) % MAX_FORTHS] = output.forked_child_id;
+            // fall through
+        case FCONTINUE_YIELD:
+        case FCONTINUE_OUTPUT_FLUSH:
+            queue[(head + count++) % MAX_FORTHS] = forth;
+            break;
+        default:
+            if (forths[root[forth]] == forth)
+            {
+                result->result_code = output.result_code;
+            }
+            break;
+        }
+    }
+    exit(0);
+}
+
+/*
+run_forths_in_parallel
+
+Runs each of the n forths in forths[] until its input is done (or it
+hits an error), spread over up to workers processes so they can use
+several cores at once.  Each worker gets its own copy of the frames
+file, so the universal region works as usual inside it.  A worker
+takes turns between its forths like a scheduler, running each until
+its next event, and runs any forths they fork too.  Everything a forth
+and its forked children print goes into results[i].output, cut off if
+it doesn't fit.  results[i].result_code is how forths[i] finished.
+The forths' progress stays in the workers, so afterwards they can't
+be run again in this process.
+ */
+void run_forths_in_parallel(int *forths, int n, int workers, struct run_output *results)
+{
+    struct run_output *shared = mmap(NULL, n * sizeof *shared, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        perror("results map failed");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        shared[i].output[0] = '\0';
+        shared[i].result_code = FCONTINUE_ERROR;
+        shared[i].forked_child_id = -1;
+    }
+    if (workers > n)
+    {
+        workers = n;
+    }
+    // so the workers don't each print what's buffered so far
+    fflush(stdout);
+    pid_t pids[workers];
+    for (int w = 0; w < workers; w++)
+    {
+        pids[w] = fork();
+        if (pids[w] < 0)
+        {
+            perror("fork failed");
+            exit(1);
+        }
+        if (pids[w] == 0)
+        {
+            run_worker(forths, n, w, workers, shared);
+        }
+    }
+    for (int w = 0; w < workers; w++)
+    {
+        int status;
+        if (waitpid(pids[w], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            printf("a forth worker process failed\n");
+            exit(1);
+        }
+    }
+    memcpy(results, shared, n * sizeof *shared);
+    munmap(shared, n * sizeof *shared);
+}
@@ -10,6 +10,10 @@ struct run_output {
 
 struct run_output run_forth_until_event(int forth_to_run);
 
+// runs the n forths to the end on up to workers processes at once,
+// with one result each
+void run_forths_in_parallel(int* forths, int n, int workers, struct run_output* results);
+
 int get_used_pages_count();
 
 // we need a special return code for forth to use when it wants to
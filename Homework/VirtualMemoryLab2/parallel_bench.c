@@ -0,0 +1,69 @@
+/*
+parallel_bench - how much forth work run_forths_in_parallel gets done
+as it is given more worker processes
+
+Every run creates MAX_FORTHS forths that each count down from COUNT
+in a loop of 4 forth words, then runs them all with 1, 2, 4 and 8
+workers (and one per CPU).  The total words run divided by the wall
+clock time is the aggregate throughput, which should go up about
+linearly with workers until there are as many workers as CPUs.
+
+    make parallel_bench.bin
+    ./parallel_bench.bin
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "forking_forth.h"
+#include "forth/forth_embed.h"
+
+#define FORTHS 10
+#define COUNT 20000000L
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run(int workers)
+{
+    char code[100];
+    snprintf(code, sizeof code, " : CD BEGIN 1- DUP 0= UNTIL DROP ; %ld CD .\" done\" ", COUNT);
+    int forths[FORTHS];
+    struct run_output results[FORTHS];
+    initialize_forths();
+    for(int i = 0; i < FORTHS; i++) {
+        forths[i] = create_forth(code);
+    }
+    double start = now_seconds();
+    run_forths_in_parallel(forths, FORTHS, workers, results);
+    double elapsed = now_seconds() - start;
+    for(int i = 0; i < FORTHS; i++) {
+        if(results[i].result_code != FCONTINUE_INPUT_DONE || strcmp(results[i].output, "done") != 0) {
+            printf("forth %d finished with %d printing \"%s\"\n", i, results[i].result_code, results[i].output);
+            exit(1);
+        }
+    }
+    double words = 4.0 * COUNT * FORTHS;
+    printf("%10d %10.3f %14.1f\n", workers, elapsed, words / elapsed / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+
+    int worker_counts[] = {1, 2, 4, 8};
+    int num_counts = sizeof worker_counts / sizeof *worker_counts;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("%d forths counting down from %ld, %ld CPUs\n", FORTHS, COUNT, cpus);
+    printf("%10s %10s %14s\n", "workers", "seconds", "Mwords/sec");
+    for(int i = 0; i < num_counts; i++) {
+        run(worker_counts[i]);
+    }
+    if(cpus > worker_counts[num_counts - 1]) {
+        run(cpus);
+    }
+}